@@ -74,12 +74,28 @@ void status() {
             }
         }();
 
+        // Missing when the daemon predates it.
+        const std::string gamma_skipped_str = [&] {
+            if (screens[idx].contains("gamma_skipped") && screens[idx]["gamma_skipped"].get<int64_t>() > -1) {
+                return fmt::format("{}", screens[idx]["gamma_skipped"].get<int64_t>());
+            } else {
+                return not_available;
+            }
+        }();
+
         fmt::format_to(std::back_inserter(rows),
-                       "[screen {}] backlight: {}, brightness: {}, temperature: {}\n",
-                       idx, backlight_str, brightness_str, temperature_str);
+                       "[screen {}] backlight: {}, brightness: {}, temperature: {}, skipped gamma updates: {}\n",
+                       idx, backlight_str, brightness_str, temperature_str, gamma_skipped_str);
 
     }
 
+    // The ramp cache is shared, every screen reports the same counts.
+    if (!screens.empty() && screens[0].contains("ramp_cache_hits") && screens[0]["ramp_cache_hits"].get<int64_t>() > -1) {
+        fmt::format_to(std::back_inserter(rows),
+                       "gamma ramp cache: {} hits, {} misses\n",
+                       screens[0]["ramp_cache_hits"].get<int64_t>(), screens[0]["ramp_cache_misses"].get<int64_t>());
+    }
+
     fmt::print("{}", rows);
 	std::exit(EXIT_SUCCESS);
 }
@@ -124,7 +140,7 @@ std::string relative_validator(const std::string &str, bool &relative_flag, rang
     return fmt::format("Value {} not in range [{} - {}]", val, range.min, range.max);
 };
 
-constexpr int option_count = 25;
+constexpr int option_count = 28;
 static constexpr std::array<std::array<const char*, 2>, option_count> options {{
     {"-v,--version", "Print version and exit"},
     {"-s,--screen", "Index on which to apply screen-related settings. If omitted, any changes will be applied on all screens."},
@@ -150,7 +166,10 @@ static constexpr std::array<std::array<const char*, 2>, option_count> options {{
 
     {"--screenlight-scale", "Screenshot brightness multiplier. Useful for calibration."},
     {"--screenlight-poll-ms", "Time interval between each screenshot."},
+    {"--screenlight-poll-max-ms", "Longest interval between screenshots. The interval grows towards it while the screen content stays the same."},
     {"--screenlight-adaptation-ms", "Adaptation speed in milliseconds."},
+    {"--screenlight-capture", "Screen capture method. 0 = full resolution, 1 = scaled down by the X server (lower CPU usage), 2 = small scattered patches (lowest X server load)"},
+    {"--screenlight-metric", "How screen brightness is measured. 0 = mean, 1 = median, 2 = 90th percentile, 3 = average picture level (linear light)"},
 
     {"--als-scale", "ALS signal multiplier. Useful for calibration."},
     {"--als-poll-ms", "Time interval between each sensor reading."},
@@ -185,7 +204,10 @@ enum option_id {
 
     SCREENSHOT_SCALE,
     SCREENSHOT_POLL_MS,
+    SCREENSHOT_POLL_MAX_MS,
     SCREENSHOT_ADAPTATION_MS,
+    SCREENSHOT_CAPTURE,
+    SCREENSHOT_METRIC,
 
     ALS_SCALE,
     ALS_POLL_MS,
@@ -297,6 +319,9 @@ int interface(int argc, char **argv) {
     models.temperature.fill(unset);
     int gamma_enabled   (unset);
     int gamma_refresh_s (unset);
+    int screenlight_poll_max_ms (unset);
+    int screenlight_capture (unset);
+    int screenlight_metric (unset);
     sensor  als { unset_fp, unset, unset };
     sensor  screenlight { unset_fp, unset, unset };
     service time {"", "", unset};
@@ -313,6 +338,7 @@ int interface(int argc, char **argv) {
     const range screenlight_range_scale(0.0, 10.0);
     const range screenlight_range_adaptation_ms(1, 10000);
     const range screenlight_range_poll_ms(1, 10000);
+    const range screenlight_range_poll_max_ms(1, 10000 * 6);
     const range time_range_adaptation_minutes(1, 60 * 12);
 
     // Flags signaling relative increments/decrements.
@@ -343,7 +369,10 @@ int interface(int argc, char **argv) {
 
     app.add_option(options[SCREENSHOT_SCALE][0], screenlight.scale, options[SCREENSHOT_SCALE][1])->check(CLI::Validator([&] (const std::string &s) { return relative_validator(s, rel_fl[SCREENSHOT_SCALE], screenlight_range_scale); }, screenlight_range_scale.desc()))->group(service_group_strings[1]);
     app.add_option(options[SCREENSHOT_POLL_MS][0], screenlight.poll_ms, options[SCREENSHOT_POLL_MS][1])->check(CLI::Validator([&] (const std::string &s) { return relative_validator(s, rel_fl[SCREENSHOT_POLL_MS], screenlight_range_poll_ms); }, screenlight_range_poll_ms.desc()))->group(service_group_strings[1]);
+    app.add_option(options[SCREENSHOT_POLL_MAX_MS][0], screenlight_poll_max_ms, options[SCREENSHOT_POLL_MAX_MS][1])->check(CLI::Validator([&] (const std::string &s) { return relative_validator(s, rel_fl[SCREENSHOT_POLL_MAX_MS], screenlight_range_poll_max_ms); }, screenlight_range_poll_max_ms.desc()))->group(service_group_strings[1]);
     app.add_option(options[SCREENSHOT_ADAPTATION_MS][0], screenlight.adaptation_ms, options[SCREENSHOT_ADAPTATION_MS][1])->check(CLI::Validator([&] (const std::string &s) { return relative_validator(s, rel_fl[SCREENSHOT_ADAPTATION_MS], screenlight_range_adaptation_ms); }, screenlight_range_adaptation_ms.desc()))->group(service_group_strings[1]);
+    app.add_option(options[SCREENSHOT_CAPTURE][0], screenlight_capture, options[SCREENSHOT_CAPTURE][1])->check(CLI::Range(0, 2))->group(service_group_strings[1]);
+    app.add_option(options[SCREENSHOT_METRIC][0], screenlight_metric, options[SCREENSHOT_METRIC][1])->check(CLI::Range(0, 3))->group(service_group_strings[1]);
 
     app.add_option(options[TIME_START][0], time.start, options[TIME_START][1])->check(check_time_format)->group(service_group_strings[2]);
     app.add_option(options[TIME_END][0], time.end, options[TIME_END][1])->check(check_time_format)->group(service_group_strings[2]);
@@ -381,13 +410,23 @@ int interface(int argc, char **argv) {
     setif(config_json["time"]["adaptation_minutes"], time.adaptation_minutes, rel_fl[TIME_ADAPTATION_MINUTES], time_range_adaptation_minutes);
     setif(config_json["screenlight"]["scale"], screenlight.scale, rel_fl[SCREENSHOT_SCALE], screenlight_range_scale);
     setif(config_json["screenlight"]["poll_ms"], screenlight.poll_ms, rel_fl[SCREENSHOT_POLL_MS], screenlight_range_poll_ms);
+    setif(config_json["screenlight"]["poll_max_ms"], screenlight_poll_max_ms, rel_fl[SCREENSHOT_POLL_MAX_MS], screenlight_range_poll_max_ms);
     setif(config_json["screenlight"]["adaptation_ms"], screenlight.adaptation_ms, rel_fl[SCREENSHOT_ADAPTATION_MS], screenlight_range_adaptation_ms);
+    setif(config_json["screenlight"]["capture_mode"], screenlight_capture);
+    setif(config_json["screenlight"]["metric"], screenlight_metric);
     setif(config_json["als"]["scale"], als.scale, rel_fl[ALS_SCALE], als_range_scale);
     setif(config_json["als"]["poll_ms"], als.poll_ms, rel_fl[ALS_POLL_MS], als_range_poll_ms);
     setif(config_json["als"]["adaptation_ms"], als.adaptation_ms, rel_fl[ALS_ADAPTATION_MS], als_range_adaptation_ms);
     setif(config_json["gamma"]["enabled"], gamma_enabled);
     setif(config_json["gamma"]["refresh_s"], gamma_refresh_s);
 
+    // The screenlight back-off can't poll faster than poll_ms.
+    if (auto &sl = config_json["screenlight"]; sl["poll_max_ms"].is_number_integer() && sl["poll_ms"].is_number_integer()
+            && sl["poll_max_ms"].get<int>() < sl["poll_ms"].get<int>()) {
+        fmt::print("screenlight poll_max_ms raised to poll_ms ({}).\n", sl["poll_ms"].get<int>());
+        sl["poll_max_ms"] = sl["poll_ms"];
+    }
+
     const auto update_screen_config = [&] (size_t idx) {
         if (idx > config_json["screens"].size() - 1) {
             fmt::print("Invalid screen number. Run `gummy status` to check for valid ones.\n");
@@ -5,12 +5,18 @@
 #define CHANNEL_HPP
 
 #include <atomic>
+#include <mutex>
+#include <chrono>
+#include <condition_variable>
 
 namespace gummyd {
 
 template <class T>
 class channel {
 	T _data;
+	// Only for wait_until(), atomic waits cannot time out.
+	mutable std::mutex _mutex;
+	mutable std::condition_variable _cv;
 public:
 	channel(T data) : _data(data) {};
 
@@ -23,9 +29,21 @@ public:
 		return read();
 	}
 
+	// Block until `pred` holds after a send(), or until `deadline`. Returns pred().
+	template <class Pred>
+	bool wait_until(std::chrono::steady_clock::time_point deadline, Pred pred) const {
+		std::unique_lock lock(_mutex);
+		return _cv.wait_until(lock, deadline, pred);
+	}
+
 	void send(T in) {
 		std::atomic_ref(_data).store(in);
 		std::atomic_ref(_data).notify_all();
+		// Waiters check the data with the mutex held: taking it here means none can miss the notification.
+		{
+			std::lock_guard lock(_mutex);
+		}
+		_cv.notify_all();
 	}
 };
 
@@ -1,6 +1,7 @@
 // Copyright 2021-2024 Francesco Fusco <f.fusco@pm.me>
 // SPDX-License-Identifier: GPL-3.0-or-later
 
+#include <algorithm>
 #include <fstream>
 #include <nlohmann/json.hpp>
 #include <spdlog/spdlog.h>
@@ -12,6 +13,18 @@
 using nlohmann::json;
 using namespace gummyd;
 
+// Reads an integer key that older config files may lack, keeping the fallback
+// when it is missing or has the wrong type.
+static int value_or(const json &obj, const char *key, int fallback)
+{
+	try {
+		return obj.value(key, fallback);
+	} catch (const nlohmann::json::exception &e) {
+		spdlog::error("[config] {}: {}", key, e.what());
+		return fallback;
+	}
+}
+
 void config::defaults()
 {
     filepath_ = xdg_config_dir() / constants::config_filename;
@@ -22,7 +35,10 @@ void config::defaults()
 
 	screenshot.scale         = 1.0;
 	screenshot.poll_ms       = 200;
+	screenshot.poll_max_ms   = 2000;
 	screenshot.adaptation_ms = 5000;
+	screenshot.capture       = screenshot::capture_mode::FULL;
+	screenshot.metric        = screenshot::luma_metric::MEAN;
 
 	als.scale                = 1.0;
 	als.poll_ms              = 5000;
@@ -175,6 +191,30 @@ void config::from_json(json in)
     } catch (const nlohmann::json::exception &e) {
         spdlog::error(e.what());
     }
+
+    // Keys added later are read one by one, so that a missing one keeps
+    // its default without skipping the others.
+    const json &sl = in["screenlight"];
+    if (!sl.is_object()) {
+        return;
+    }
+
+    const int capture = value_or(sl, "capture_mode", int(screenshot.capture));
+    if (capture >= int(screenshot::capture_mode::FULL) && capture <= int(screenshot::capture_mode::PATCHES)) {
+        screenshot.capture = screenshot::capture_mode(capture);
+    } else {
+        spdlog::warn("[config] invalid screenlight.capture_mode {}, keeping {}", capture, int(screenshot.capture));
+    }
+
+    const int metric = value_or(sl, "metric", int(screenshot.metric));
+    if (metric >= int(screenshot::luma_metric::MEAN) && metric <= int(screenshot::luma_metric::APL)) {
+        screenshot.metric = screenshot::luma_metric(metric);
+    } else {
+        spdlog::warn("[config] invalid screenlight.metric {}, keeping {}", metric, int(screenshot.metric));
+    }
+
+    // The back-off never polls faster than poll_ms.
+    screenshot.poll_max_ms = std::max(value_or(sl, "poll_max_ms", screenshot.poll_max_ms), screenshot.poll_ms);
 }
 
 json config::to_json() const
@@ -191,7 +231,10 @@ json config::to_json() const
 		{"screenlight", {
 				{"scale", screenshot.scale},
 				{"poll_ms", screenshot.poll_ms},
+				{"poll_max_ms", screenshot.poll_max_ms},
 				{"adaptation_ms", screenshot.adaptation_ms},
+				{"capture_mode", screenshot.capture},
+				{"metric", screenshot.metric},
 		}},
 
 		{"als", {
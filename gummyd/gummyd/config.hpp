@@ -4,6 +4,7 @@
 #ifndef CONFIG_HPP
 #define CONFIG_HPP
 
+#include <array>
 #include <string>
 #include <filesystem>
 #include <nlohmann/json_fwd.hpp>
@@ -35,9 +36,24 @@ public:
     } time;
 
     struct screenshot {
+        enum class capture_mode {
+            FULL,
+            THUMBNAIL,
+            PATCHES,
+        };
+        enum class luma_metric {
+            MEAN,
+            MEDIAN,
+            P90,
+            APL,
+        };
         double scale;
         int poll_ms;
+        // Upper bound for the polling interval while the screen is static.
+        int poll_max_ms;
         int adaptation_ms;
+        capture_mode capture;
+        luma_metric metric;
     } screenshot;
 
     struct als {
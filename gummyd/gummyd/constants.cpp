@@ -2,6 +2,7 @@
 // SPDX-License-Identifier: GPL-3.0-or-later
 
 #include <gummyd/constants.hpp>
+#include <gummyd/kelvin.hpp>
 #include <string_view>
 
 namespace gummyd {
@@ -11,6 +12,6 @@ constexpr std::string_view fifo_filename   = "gummyd-fifo";
 constexpr std::string_view config_filename = "gummyconf.json";
 constexpr int brt_steps_min  = 200;
 constexpr int brt_steps_max  = 1000;
-constexpr int temp_k_min     = 1000;
-constexpr int temp_k_max     = 6500;
+constexpr int temp_k_min     = kelvin::min;
+constexpr int temp_k_max     = kelvin::max;
 }}
@@ -2,6 +2,9 @@
 // SPDX-License-Identifier: GPL-3.0-or-later
 
 #include <span>
+#include <deque>
+#include <optional>
+#include <climits>
 #include <filesystem>
 #include <condition_variable>
 #include <fmt/chrono.h>
@@ -14,16 +17,80 @@
 #include <gummyd/utils.hpp>
 #include <gummyd/constants.hpp>
 #include <gummyd/file.hpp>
+#include <gummyd/luminance.hpp>
+
+// Side of the square areas whose luminance is cached between captures.
+static constexpr int screenlight_tile_size = 256;
+
+// Width of server-side scaled captures. Height follows the output's aspect ratio.
+static constexpr uint16_t screenlight_thumbnail_width = 64;
+
+// Patches read on each output in patch mode, and their side.
+static constexpr size_t screenlight_patch_count = 64;
+static constexpr int    screenlight_patch_size  = 8;
+
+// Upper bound on the threads reading full captures, the coordinator included.
+static constexpr unsigned screenlight_max_threads = 4;
+
+static int screenlight_measure(const gummyd::luminance::histogram &hist, gummyd::config::screenshot::luma_metric metric) {
+    using enum gummyd::config::screenshot::luma_metric;
+    switch (metric) {
+    case MEAN:
+        return gummyd::luminance::mean(hist);
+    case MEDIAN:
+        return gummyd::luminance::median(hist);
+    case P90:
+        return gummyd::luminance::percentile(hist, 0.9);
+    case APL:
+        return gummyd::luminance::apl(hist);
+    }
+    return gummyd::luminance::mean(hist);
+}
 
-// [0, 255]
-int image_brightness(uint8_t *buf, size_t sz, int bytes_per_pixel = 4, int stride = 1024) {
-    std::array<uint64_t, 3> rgb {};
-    for (uint64_t i = 0, inc = stride * bytes_per_pixel; i < sz; i += inc) {
-        rgb[0] += buf[i + 2];
-        rgb[1] += buf[i + 1];
-        rgb[2] += buf[i];
+// Last value sent to a screenlight client, and how far measurements drifted from it since.
+struct screenlight_level {
+    int cur   = gummyd::constants::brt_steps_max;
+    int delta = 0;
+
+    // Whether the new measurement moved far enough to be sent.
+    bool update(int brightness, double scale) {
+        const int prev = cur;
+        cur = std::clamp(double(brightness) * scale, 0., 255.);
+        delta += std::abs(prev - cur);
+        if (delta > 8) {
+            delta = 0;
+            return true;
+        }
+        return false;
     }
-    return ((rgb[0] * 0.2126) + (rgb[1] * 0.7152) + (rgb[2] * 0.0722)) * stride / (sz / bytes_per_pixel);
+};
+
+// Back off while every screen stays within the dead band,
+// go back to the configured rate as soon as one of them changes.
+static int screenlight_next_poll(int poll_ms, bool changed, const struct gummyd::config::screenshot &conf) {
+    if (changed)
+        return conf.poll_ms;
+    return std::min(poll_ms * 2, std::max(conf.poll_ms, conf.poll_max_ms));
+}
+
+// Kernel for images in the given layout. Unknown ones are read as BGRX.
+static gummyd::luminance::pixel_format screenlight_pixel_format(const gummyd::xcb::image_format &f) {
+    if (const auto ret = gummyd::luminance::find_pixel_format(f.bits_per_pixel, f.red_mask, f.green_mask, f.blue_mask, f.msb_first))
+        return *ret;
+    spdlog::warn("[screenlight_server] unsupported pixel format ({} bpp, masks: {:#x} {:#x} {:#x}), assuming BGRX", f.bits_per_pixel, f.red_mask, f.green_mask, f.blue_mask);
+    return gummyd::luminance::pixel_format::BGRX32;
+}
+
+// Run a capture, retrying for a while if the X server returns an error.
+static void capture_retry(std::function<int()> capture) {
+    for (int tries = 0; tries < 10; ++tries) {
+        const int ret = capture();
+        if (ret > -1)
+            return;
+        spdlog::error("failed to get screen data [error: {}], retrying ({})...", ret, tries + 1);
+        std::this_thread::sleep_for(std::chrono::milliseconds(500));
+    }
+    throw std::runtime_error("failed to get screen data after 10 tries");
 }
 
 void gummyd::jthread_wait_until(std::chrono::milliseconds ms, std::stop_token stoken) {
@@ -34,44 +101,311 @@ void gummyd::jthread_wait_until(std::chrono::milliseconds ms, std::stop_token st
             .wait_until(lock, stoken, system_clock::now() + ms, [&] { return stoken.stop_requested(); });
 }
 
-void gummyd::screenlight_server(xcb::shared_image &shimg, xcb::randr::output &output, channel<int> &ch, struct config::screenshot conf, std::stop_token stoken)
+void gummyd::screenlight_server(xcb::shared_image &shimg, const std::vector<xcb::randr::output> &outputs, std::map<size_t, channel<int>> &channels, struct config::screenshot conf, std::stop_token stoken)
 {
-    int cur = constants::brt_steps_max;
-	int prev;
-	int delta = 0;
+    struct screen {
+        const xcb::randr::output &output;
+        channel<int> &ch;
+        luminance::tile_grid tiles;
+        luminance::rect thumbnail_area;
+        int brightness;
+        screenlight_level level;
+    };
+
+    // Full captures come in the root window's own layout.
+    const luminance::pixel_format format = screenlight_pixel_format(shimg.format());
+
+    std::vector<screen> screens;
+    for (auto &[idx, ch] : channels) {
+        const xcb::randr::output &o = outputs[idx];
+        screens.push_back({
+            o,
+            ch,
+            luminance::tile_grid({o.x, o.y, o.width, o.height}, screenlight_tile_size, format),
+            {},
+            0,
+            {},
+        });
+    }
+
+    // Area covering every captured output, grabbed at most once per tick.
+    const luminance::rect area = [&] {
+        int x0 = INT_MAX, y0 = INT_MAX, x1 = INT_MIN, y1 = INT_MIN;
+        for (const screen &s : screens) {
+            x0 = std::min(x0, int(s.output.x));
+            y0 = std::min(y0, int(s.output.y));
+            x1 = std::max(x1, s.output.x + s.output.width);
+            y1 = std::max(y1, s.output.y + s.output.height);
+        }
+        return luminance::rect {x0, y0, x1 - x0, y1 - y0};
+    }();
+
+    // Without DAMAGE, every tile is read again on each tick.
+    std::optional<xcb::damage> damage = [&] {
+        try {
+            return std::optional<xcb::damage>(std::in_place);
+        } catch (const std::runtime_error &e) {
+            spdlog::warn("[screenlight_server] {}, polling whole outputs", e.what());
+            return std::optional<xcb::damage>();
+        }
+    }();
+
+    // In thumbnail mode the whole area is scaled down in one go,
+    // so that the narrowest output still gets the full thumbnail width.
+    std::optional<xcb::thumbnail> thumbnail = [&] {
+        if (conf.capture != config::screenshot::capture_mode::THUMBNAIL)
+            return std::optional<xcb::thumbnail>();
+
+        const int min_width = std::ranges::min_element(screens, {}, [] (const screen &s) { return s.output.width; })->output.width;
+        const double factor = std::max(1., double(min_width) / screenlight_thumbnail_width);
+
+        for (screen &s : screens) {
+            s.thumbnail_area = {
+                int((s.output.x - area.x) / factor),
+                int((s.output.y - area.y) / factor),
+                std::max(1, int(s.output.width / factor)),
+                std::max(1, int(s.output.height / factor)),
+            };
+        }
+
+        try {
+            return std::optional<xcb::thumbnail>(std::in_place,
+                                                 uint16_t(std::ceil(area.w / factor)),
+                                                 uint16_t(std::ceil(area.h / factor)));
+        } catch (const std::runtime_error &e) {
+            spdlog::warn("[screenlight_server] {}, using full captures", e.what());
+            return std::optional<xcb::thumbnail>();
+        }
+    }();
+
+    // The thumbnail has its own picture format, and the server's byte order.
+    const luminance::pixel_format thumbnail_format = thumbnail.has_value() ? screenlight_pixel_format(thumbnail->format()) : format;
+
+    // In patch mode, a few small squares of each output are read instead of the whole output.
+    // patch_screen maps each patch to the screen it belongs to.
+    std::vector<size_t> patch_screen;
+    std::optional<xcb::patches> patches = [&] {
+        if (conf.capture != config::screenshot::capture_mode::PATCHES)
+            return std::optional<xcb::patches>();
+
+        std::vector<xcb_rectangle_t> rects;
+        for (size_t i = 0; i < screens.size(); ++i) {
+            const xcb::randr::output &o = screens[i].output;
+            for (const luminance::rect &r : luminance::patches({o.x, o.y, o.width, o.height}, screenlight_patch_count, screenlight_patch_size)) {
+                rects.push_back({int16_t(r.x), int16_t(r.y), uint16_t(r.w), uint16_t(r.h)});
+                patch_screen.push_back(i);
+            }
+        }
+        return std::optional<xcb::patches>(std::in_place, std::move(rects));
+    }();
+
+    // Thumbnails and patches are small enough to be read by the coordinator alone.
+    worker_pool pool(thumbnail.has_value() || patches.has_value() ? 0 : std::clamp(std::thread::hardware_concurrency(), 1u, screenlight_max_threads) - 1);
+
+    int poll_ms = conf.poll_ms;
+    int capture_failures = 0;
+
+    // Full captures on their way, oldest first. Each one holds the tiles it was requested for, per screen.
+    struct grab {
+        std::vector<luminance::tile_grid::capture> tiles;
+        luminance::rect area;
+    };
+    std::deque<grab> grabs;
+
+    const auto reduce_buf = [&] (const grab &g, std::span<uint8_t> buf) {
+        for (size_t i = 0; i < screens.size(); ++i)
+            screens[i].tiles.update(g.tiles[i], buf, g.area, buf.size() / g.area.h, pool);
+        return 0;
+    };
+
+    // Called with the result of the oldest grab, once it has been read.
+    const auto reduce = [&] (int ret) {
+        // Tiles of a failed grab are requested again on the next tick.
+        if (ret != 0) {
+            spdlog::error("failed to get screen data [error: {}]", ret);
+            for (size_t i = 0; i < screens.size(); ++i)
+                screens[i].tiles.restore(grabs.front().tiles[i]);
+        }
+        capture_failures = ret != 0 ? capture_failures + 1 : 0;
+        grabs.pop_front();
+    };
+
 	while (true) {
-        prev = cur;
-
-		const int brightness = [&] {
-            for (int tries = 0; tries < 10; ++tries) {
-                const auto ret = shimg.get(output.x, output.y, output.width, output.height,
-                                           [] (std::span<uint8_t> buf) { return image_brightness(buf.data(), buf.size()); });
-                if (ret > -1)
-                    return ret;
-				spdlog::error("failed to get screen data [error: {}], retrying ({})...", ret, tries + 1);
-				std::this_thread::sleep_for(std::chrono::milliseconds(500));
-			}
-			throw std::runtime_error("failed to get screen data after 10 tries");
-		}();
-
-		cur = std::clamp(double(brightness) * conf.scale, 0., 255.);
-		delta += std::abs(prev - cur);
-
-		if (delta > 8) {
-			delta = 0;
-            spdlog::debug("[screenlight_server (scr: {})] sending: {}", output.id, cur);
-			ch.send(cur);
-		}
+        if (damage.has_value()) {
+            for (const xcb_rectangle_t &r : damage->collect()) {
+                for (screen &s : screens)
+                    s.tiles.mark({r.x, r.y, r.width, r.height});
+            }
+        } else {
+            for (screen &s : screens)
+                s.tiles.mark_all();
+        }
 
-		jthread_wait_until(std::chrono::milliseconds(conf.poll_ms), stoken);
+        if (!grabs.empty() || std::ranges::any_of(screens, [] (const screen &s) { return s.tiles.dirty(); })) {
+            if (thumbnail.has_value()) {
+                // The thumbnail is recomputed as a whole, tiles only tell whether anything changed.
+                capture_retry([&] {
+                    return thumbnail->get(area.x, area.y, area.w, area.h, [&] (std::span<uint8_t> buf) {
+                        const size_t pitch = buf.size() / thumbnail->height();
+                        for (screen &s : screens) {
+                            luminance::histogram hist {};
+                            luminance::histogram_pixels(thumbnail_format, buf, pitch, s.thumbnail_area, hist);
+                            s.brightness = screenlight_measure(hist, conf.metric);
+                        }
+                        return 0;
+                    });
+                });
+                for (screen &s : screens)
+                    s.tiles.clear();
+            } else if (patches.has_value()) {
+                // Tiles only tell whether anything changed, every patch is read again.
+                std::vector<luminance::histogram> hists(screens.size());
+                const int ret = patches->get([&] (size_t idx, std::span<const uint8_t> buf, size_t pitch) {
+                    luminance::histogram_pixels(format, buf, pitch, {0, 0, screenlight_patch_size, screenlight_patch_size}, hists[patch_screen[idx]]);
+                });
+
+                if (ret != 0) {
+                    spdlog::error("failed to get screen data [error: {}]", ret);
+                    ++capture_failures;
+                } else {
+                    capture_failures = 0;
+                    for (size_t i = 0; i < screens.size(); ++i) {
+                        screens[i].brightness = screenlight_measure(hists[i], conf.metric);
+                        screens[i].tiles.clear();
+                    }
+                }
+
+                if (capture_failures >= 10)
+                    throw std::runtime_error("failed to get screen data after 10 tries");
+            } else {
+                // One grab per tick, of the area covering the dirty tiles of every output.
+                // It is read on the next tick, while the server copies the following one into the other segment,
+                // or right away if it has already arrived.
+                if (std::ranges::any_of(screens, [] (const screen &s) { return s.tiles.dirty(); })) {
+                    // Both segments are taken: the oldest grab has to be read before a new one can go.
+                    if (grabs.size() == 2)
+                        reduce(shimg.collect([&] (std::span<uint8_t> buf) { return reduce_buf(grabs.front(), buf); }));
+
+                    grab g;
+                    int x0 = INT_MAX, y0 = INT_MAX, x1 = INT_MIN, y1 = INT_MIN;
+                    for (screen &s : screens) {
+                        const luminance::rect r = g.tiles.emplace_back(s.tiles.take()).area;
+                        if (r.w == 0)
+                            continue;
+                        x0 = std::min(x0, r.x);
+                        y0 = std::min(y0, r.y);
+                        x1 = std::max(x1, r.x + r.w);
+                        y1 = std::max(y1, r.y + r.h);
+                    }
+                    g.area = {x0, y0, x1 - x0, y1 - y0};
+
+                    shimg.request(g.area.x, g.area.y, g.area.w, g.area.h);
+                    grabs.push_back(std::move(g));
+                }
+
+                while (!grabs.empty()) {
+                    const std::optional<int> ret = shimg.poll([&] (std::span<uint8_t> buf) { return reduce_buf(grabs.front(), buf); });
+                    if (!ret.has_value())
+                        break;
+                    reduce(*ret);
+                }
+
+                if (capture_failures >= 10) {
+                    shimg.discard();
+                    throw std::runtime_error("failed to get screen data after 10 tries");
+                }
+
+                for (screen &s : screens)
+                    s.brightness = screenlight_measure(s.tiles.merged(), conf.metric);
+            }
+        }
+
+        bool changed = false;
+        for (screen &s : screens) {
+            if (s.level.update(s.brightness, conf.scale)) {
+                changed = true;
+                spdlog::debug("[screenlight_server (scr: {})] sending: {}", s.output.id, s.level.cur);
+                s.ch.send(s.level.cur);
+            }
+        }
+
+        poll_ms = screenlight_next_poll(poll_ms, changed, conf);
+
+		jthread_wait_until(std::chrono::milliseconds(poll_ms), stoken);
 
 		if (stoken.stop_requested()) {
-			ch.send(-1);
+            // The segments outlive this server.
+            shimg.discard();
+            for (screen &s : screens)
+                s.ch.send(-1);
 			return;
 		}
 	}
 }
 
+void gummyd::screenlight_server(wl::screencopy &screencopy, std::map<size_t, channel<int>> &channels, struct config::screenshot conf, std::stop_token stoken)
+{
+    struct screen {
+        channel<int> &ch;
+        // Created from the first frame, and again whenever the compositor hands out a new buffer.
+        std::optional<luminance::tile_grid> tiles;
+        int brightness;
+        screenlight_level level;
+    };
+
+    std::map<size_t, screen> screens;
+    for (auto &[idx, ch] : channels)
+        screens.try_emplace(idx, ch, std::nullopt, 0, screenlight_level {});
+
+    if (conf.capture != config::screenshot::capture_mode::FULL)
+        spdlog::info("[screenlight_server] only full captures are available on Wayland");
+
+    worker_pool pool(std::clamp(std::thread::hardware_concurrency(), 1u, screenlight_max_threads) - 1);
+
+    int poll_ms = conf.poll_ms;
+
+    while (true) {
+        // Frames only complete once their output is damaged, so a static output yields nothing here.
+        screencopy.dispatch([&] (size_t idx, const wl::screencopy::frame &f) {
+            const auto it = screens.find(idx);
+            if (it == screens.end())
+                return;
+
+            screen &s = it->second;
+            const luminance::rect area {0, 0, f.width, f.height};
+
+            if (f.full || !s.tiles.has_value()) {
+                s.tiles.emplace(area, screenlight_tile_size, f.format);
+            } else {
+                for (const luminance::rect &r : f.damage)
+                    s.tiles->mark(r);
+            }
+
+            s.tiles->update(f.data, area, f.stride, pool);
+            s.brightness = screenlight_measure(s.tiles->merged(), conf.metric);
+        });
+
+        bool changed = false;
+        for (auto &[idx, s] : screens) {
+            if (s.tiles.has_value() && s.level.update(s.brightness, conf.scale)) {
+                changed = true;
+                spdlog::debug("[screenlight_server (scr: {})] sending: {}", idx, s.level.cur);
+                s.ch.send(s.level.cur);
+            }
+        }
+
+        poll_ms = screenlight_next_poll(poll_ms, changed, conf);
+
+        jthread_wait_until(std::chrono::milliseconds(poll_ms), stoken);
+
+        if (stoken.stop_requested()) {
+            for (auto &[idx, s] : screens)
+                s.ch.send(-1);
+            return;
+        }
+    }
+}
+
 void gummyd::screenlight_client(const channel<int> &ch, size_t screen_idx, config::screen::model model, std::function<void(int)> model_fn, int adaptation_ms)
 {
     const auto state_dir = xdg_state_dir() / fmt::format("gummyd/screen-{}", screen_idx);
@@ -100,8 +434,8 @@ void gummyd::screenlight_client(const channel<int> &ch, size_t screen_idx, confi
 
 		const int target = remap(brt, 0, 255, model.max, model.min);
 
-		const auto interrupt = [&] {
-			return ch.read() != brt;
+		const auto interrupt = [&] (std::chrono::steady_clock::time_point deadline) {
+			return ch.wait_until(deadline, [&] { return ch.read() != brt; });
 		};
 
         spdlog::debug("[model: {}, client: screenlight] easing from {} to {}...", config::screen::model_name(model.id), val, target);
@@ -171,8 +505,8 @@ void gummyd::als_client(const channel<double> &ch, size_t screen_idx, config::sc
 
 		const int target = lerp(model.min, model.max, std::clamp(brt, 0., 1.));
 
-		const auto interrupt = [&] {
-			return ch.read() != brt;
+		const auto interrupt = [&] (std::chrono::steady_clock::time_point deadline) {
+			return ch.wait_until(deadline, [&] { return ch.read() != brt; });
 		};
 
         spdlog::debug("[als client] easing from {} to {}...", val, target);
@@ -267,8 +601,8 @@ void gummyd::time_client(const channel<time_data> &ch, size_t screen_idx, config
 		if (data.in_range < 0)
             break;
 
-		const auto interrupt = [&] {
-			return ch.read().time_since_last_event != data.time_since_last_event;
+		const auto interrupt = [&] (std::chrono::steady_clock::time_point deadline) {
+			return ch.wait_until(deadline, [&] { return ch.read().time_since_last_event != data.time_since_last_event; });
 		};
 
 		for (int step = 0; step < 2; ++step) {
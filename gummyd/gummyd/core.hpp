@@ -4,6 +4,7 @@
 #ifndef CORE_HPP
 #define CORE_HPP
 
+#include <map>
 #include <functional>
 #include <stop_token>
 
@@ -11,12 +12,16 @@
 #include <gummyd/display.hpp>
 #include <gummyd/config.hpp>
 #include <gummyd/sd-sysfs-devices.hpp>
+#include <gummyd/wl-screencopy.hpp>
 
 namespace gummyd {
 
 void jthread_wait_until(std::chrono::milliseconds ms, std::stop_token stoken);
 
-void screenlight_server(xcb::shared_image&, xcb::randr::output&, channel<int> &ch, struct config::screenshot conf, std::stop_token stoken);
+// Captures every output that has a channel, once per tick, and sends each result on its own channel.
+void screenlight_server(xcb::shared_image&, const std::vector<xcb::randr::output>&, std::map<size_t, channel<int>> &channels, struct config::screenshot conf, std::stop_token stoken);
+// Same, on wlroots compositors. Channels are keyed by the order in which the compositor announced its outputs.
+void screenlight_server(wl::screencopy&, std::map<size_t, channel<int>> &channels, struct config::screenshot conf, std::stop_token stoken);
 void screenlight_client(const channel<int> &ch, size_t screen_idx, config::screen::model model, std::function<void(int)> model_fn, int adaptation_ms);
 
 void als_server(const sysfs::als &als, channel<double> &ch, struct config::als conf, std::stop_token stoken);
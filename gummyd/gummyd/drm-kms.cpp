@@ -0,0 +1,296 @@
+// Copyright 2021-2024 Francesco Fusco <f.fusco@pm.me>
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include <memory>
+#include <cerrno>
+#include <cstring>
+#include <optional>
+#include <utility>
+#include <algorithm>
+#include <filesystem>
+#include <stdexcept>
+#include <string_view>
+#include <fcntl.h>
+#include <unistd.h>
+#include <xf86drm.h>
+#include <xf86drmMode.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <systemd/sd-login.h>
+#include <spdlog/spdlog.h>
+
+#include <gummyd/utils.hpp>
+#include <gummyd/drm-kms.hpp>
+
+namespace gummyd {
+namespace drm {
+
+namespace {
+
+using resources_ptr  = std::unique_ptr<drmModeRes, deleter<drmModeRes, drmModeFreeResources>>;
+using connector_ptr  = std::unique_ptr<drmModeConnector, deleter<drmModeConnector, drmModeFreeConnector>>;
+using crtc_ptr       = std::unique_ptr<drmModeCrtc, deleter<drmModeCrtc, drmModeFreeCrtc>>;
+using properties_ptr = std::unique_ptr<drmModeObjectProperties, deleter<drmModeObjectProperties, drmModeFreeObjectProperties>>;
+using property_ptr   = std::unique_ptr<drmModePropertyRes, deleter<drmModePropertyRes, drmModeFreeProperty>>;
+using blob_ptr       = std::unique_ptr<drmModePropertyBlobRes, deleter<drmModePropertyBlobRes, drmModeFreePropertyBlob>>;
+using atomic_ptr     = std::unique_ptr<drmModeAtomicReq, deleter<drmModeAtomicReq, drmModeAtomicFree>>;
+
+struct property {
+    uint32_t id;
+    uint64_t value;
+};
+
+std::optional<property> find_property(int fd, uint32_t object_id, uint32_t object_type, std::string_view name) {
+    const properties_ptr props(drmModeObjectGetProperties(fd, object_id, object_type));
+    if (!props)
+        return std::nullopt;
+
+    for (uint32_t i = 0; i < props->count_props; ++i) {
+        const property_ptr prop(drmModeGetProperty(fd, props->props[i]));
+        if (prop && name == prop->name)
+            return property {prop->prop_id, props->prop_values[i]};
+    }
+
+    return std::nullopt;
+}
+
+double refresh_rate(const drmModeModeInfo &mode) {
+    if (mode.htotal == 0 || mode.vtotal == 0)
+        return mode.vrefresh;
+    double rate = mode.clock * 1000. / (double(mode.htotal) * double(mode.vtotal));
+    if (mode.flags & DRM_MODE_FLAG_DBLSCAN)
+        rate /= 2;
+    if (mode.flags & DRM_MODE_FLAG_INTERLACE)
+        rate *= 2;
+    return rate;
+}
+
+int open_device(const std::string &path) {
+    const int fd = open(path.c_str(), O_RDWR | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+
+    // Atomic modesetting implies universal planes, and needs them to be enabled first.
+    if (drmSetClientCap(fd, DRM_CLIENT_CAP_UNIVERSAL_PLANES, 1) != 0
+    || drmSetClientCap(fd, DRM_CLIENT_CAP_ATOMIC, 1) != 0) {
+        close(fd);
+        return -1;
+    }
+
+    // Opening a device nobody is master of makes us master. Give it back at once,
+    // or a compositor starting later could not take it.
+    if (drmIsMaster(fd))
+        drmDropMaster(fd);
+
+    return fd;
+}
+
+std::vector<output> device_outputs(int fd, const std::string &path) {
+    const resources_ptr res(drmModeGetResources(fd));
+    if (!res)
+        return {};
+
+    std::vector<output> ret;
+
+    for (int i = 0; i < res->count_connectors; ++i) {
+        const connector_ptr conn(drmModeGetConnector(fd, res->connectors[i]));
+        if (!conn || conn->connection != DRM_MODE_CONNECTED)
+            continue;
+
+        const char *type = drmModeGetConnectorTypeName(conn->connector_type);
+        const std::string name = fmt::format("{}-{}", type ? type : "Unknown", conn->connector_type_id);
+
+        // Connected, but not lit up.
+        const auto crtc_id = find_property(fd, conn->connector_id, DRM_MODE_OBJECT_CONNECTOR, "CRTC_ID");
+        if (!crtc_id || crtc_id->value == 0)
+            continue;
+
+        const auto gamma_lut      = find_property(fd, uint32_t(crtc_id->value), DRM_MODE_OBJECT_CRTC, "GAMMA_LUT");
+        const auto gamma_lut_size = find_property(fd, uint32_t(crtc_id->value), DRM_MODE_OBJECT_CRTC, "GAMMA_LUT_SIZE");
+        if (!gamma_lut || !gamma_lut_size || gamma_lut_size->value == 0) {
+            spdlog::warn("[drm] {}: no GAMMA_LUT on crtc {}", name, crtc_id->value);
+            continue;
+        }
+
+        // https://en.wikipedia.org/wiki/Extended_Display_Identification_Data
+        std::array<uint8_t, 128> edid {};
+        if (const auto prop = find_property(fd, conn->connector_id, DRM_MODE_OBJECT_CONNECTOR, "EDID"); prop && prop->value != 0) {
+            const blob_ptr blob(drmModeGetPropertyBlob(fd, uint32_t(prop->value)));
+            if (blob && blob->length >= edid.size()) {
+                std::copy_n(static_cast<const uint8_t*>(blob->data), edid.size(), edid.begin());
+            } else {
+                spdlog::warn("[drm] {} edid is {} bytes", name, blob ? blob->length : 0);
+            }
+        }
+
+        const crtc_ptr crtc(drmModeGetCrtc(fd, uint32_t(crtc_id->value)));
+
+        spdlog::info("[drm] found: {} on {}, crtc: {}, gamma size: {}", name, path, crtc_id->value, gamma_lut_size->value);
+
+        ret.push_back({
+                          path,
+                          name,
+                          edid,
+                          uint32_t(crtc_id->value),
+                          gamma_lut->id,
+                          size_t(gamma_lut_size->value),
+                          crtc && crtc->mode_valid ? refresh_rate(crtc->mode) : 0.,
+                      });
+    }
+
+    return ret;
+}
+
+} // namespace
+
+std::vector<output> outputs() {
+    std::vector<std::string> paths;
+    std::error_code ec;
+    for (const auto &entry : std::filesystem::directory_iterator("/dev/dri", ec)) {
+        if (entry.path().filename().string().starts_with("card"))
+            paths.push_back(entry.path().string());
+    }
+    std::ranges::sort(paths);
+
+    for (const std::string &path : paths) {
+        const int fd = open_device(path);
+        if (fd < 0) {
+            spdlog::debug("[drm] {}: {}", path, std::strerror(errno));
+            continue;
+        }
+        std::vector<output> ret = device_outputs(fd, path);
+        close(fd);
+        if (!ret.empty())
+            return ret;
+    }
+
+    return {};
+}
+
+device::device(const std::string &path) : fd_(open_device(path)), error_(0) {
+    if (fd_ < 0)
+        throw std::runtime_error(fmt::format("{}: atomic modesetting not available: {}", path, std::strerror(errno)));
+}
+
+device::~device() {
+    for (const queued &q : queued_)
+        drmModeDestroyPropertyBlob(fd_, q.blob_id);
+    close(fd_);
+}
+
+void device::queue_gamma(const output &out, std::span<const uint16_t> ramps) {
+    const size_t sz = ramps.size() / 3;
+
+    std::vector<drm_color_lut> lut (sz);
+    for (size_t i = 0; i < sz; ++i) {
+        lut[i].red   = ramps[0 * sz + i];
+        lut[i].green = ramps[1 * sz + i];
+        lut[i].blue  = ramps[2 * sz + i];
+    }
+
+    uint32_t blob_id;
+    if (const int ret = drmModeCreatePropertyBlob(fd_, lut.data(), lut.size() * sizeof(drm_color_lut), &blob_id); ret != 0) {
+        spdlog::error("[drm] crtc {}: drmModeCreatePropertyBlob failed: {}", out.crtc_id, std::strerror(-ret));
+        if (error_ == 0)
+            error_ = -ret;
+        return;
+    }
+
+    // A newer ramp for the same CRTC replaces the queued one.
+    const auto it = std::ranges::find(queued_, out.crtc_id, &queued::crtc_id);
+    if (it != queued_.end()) {
+        drmModeDestroyPropertyBlob(fd_, it->blob_id);
+        it->blob_id = blob_id;
+    } else {
+        queued_.push_back({out.crtc_id, out.gamma_lut, blob_id});
+    }
+}
+
+int device::commit() {
+    if (queued_.empty())
+        return std::exchange(error_, 0);
+
+    const atomic_ptr req(drmModeAtomicAlloc());
+    for (const queued &q : queued_)
+        drmModeAtomicAddProperty(req.get(), q.crtc_id, q.gamma_lut, q.blob_id);
+
+    // Master is taken for this commit only. It fails if another client holds it.
+    int ret = graphical_session_active() ? -EBUSY : (drmSetMaster(fd_) == 0 ? 0 : -errno);
+    if (ret == 0) {
+        ret = drmModeAtomicCommit(fd_, req.get(), DRM_MODE_ATOMIC_NONBLOCK, nullptr);
+        // The previous commit has not reached the screen yet. Wait for it instead of dropping this one.
+        if (ret == -EBUSY)
+            ret = drmModeAtomicCommit(fd_, req.get(), 0, nullptr);
+        drmDropMaster(fd_);
+    }
+
+    // The CRTCs keep their own references, the handles are not needed anymore.
+    for (const queued &q : queued_)
+        drmModeDestroyPropertyBlob(fd_, q.blob_id);
+    queued_.clear();
+
+    // Someone else having the device is expected, the caller decides what to report.
+    if (ret != 0 && ret != -EBUSY && ret != -EACCES && ret != -EPERM)
+        spdlog::error("[drm] atomic commit failed: {}", std::strerror(-ret));
+
+    const int queue_error = std::exchange(error_, 0);
+    return ret != 0 ? -ret : queue_error;
+}
+
+bool graphical_session_active() {
+    char *session = nullptr;
+    if (sd_seat_get_active("seat0", &session, nullptr) < 0)
+        return false;
+    const c_unique_ptr<char> session_ptr(session);
+
+    char *type = nullptr;
+    if (sd_session_get_type(session, &type) < 0)
+        return false;
+    const c_unique_ptr<char> type_ptr(type);
+
+    const std::string_view t(type);
+    return t == "x11" || t == "wayland" || t == "mir";
+}
+
+session_monitor::session_monitor() : monitor_(nullptr), stop_fd_(eventfd(0, EFD_CLOEXEC)) {
+    if (stop_fd_ < 0)
+        throw std::runtime_error(fmt::format("eventfd failed: {}", std::strerror(errno)));
+    if (const int ret = sd_login_monitor_new(nullptr, &monitor_); ret < 0) {
+        close(stop_fd_);
+        throw std::runtime_error(fmt::format("sd_login_monitor_new failed: {}", std::strerror(-ret)));
+    }
+}
+
+session_monitor::~session_monitor() {
+    sd_login_monitor_unref(monitor_);
+    close(stop_fd_);
+}
+
+bool session_monitor::wait(std::stop_token stoken) {
+    const std::stop_callback on_stop(stoken, [this] {
+        const uint64_t one = 1;
+        [[maybe_unused]] const ssize_t ret = write(stop_fd_, &one, sizeof(one));
+    });
+
+    std::array<pollfd, 2> fds {{
+        {sd_login_monitor_get_fd(monitor_), short(sd_login_monitor_get_events(monitor_)), 0},
+        {stop_fd_, POLLIN, 0},
+    }};
+
+    while (!stoken.stop_requested()) {
+        if (poll(fds.data(), fds.size(), -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            throw std::runtime_error(fmt::format("poll failed: {}", std::strerror(errno)));
+        }
+        if (fds[0].revents) {
+            sd_login_monitor_flush(monitor_);
+            return true;
+        }
+    }
+
+    return false;
+}
+
+} // namespace drm
+} // namespace gummyd
@@ -0,0 +1,81 @@
+// Copyright 2021-2024 Francesco Fusco <f.fusco@pm.me>
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#ifndef DRM_KMS_HPP
+#define DRM_KMS_HPP
+
+#include <span>
+#include <array>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <stop_token>
+
+struct sd_login_monitor;
+
+namespace gummyd {
+namespace drm {
+
+struct output {
+    // DRM device node, such as /dev/dri/card0.
+    std::string device;
+    // Connector name, such as HDMI-A-1.
+    std::string name;
+    std::array<uint8_t, 128> edid;
+    uint32_t crtc_id;
+    // Property ID of the CRTC's GAMMA_LUT.
+    uint32_t gamma_lut;
+    // GAMMA_LUT_SIZE of the CRTC.
+    size_t ramp_size;
+    // In Hz, 0 if unknown.
+    double refresh_rate;
+};
+
+// Connected outputs of the first device with atomic modesetting and a GAMMA_LUT on its active CRTCs.
+// Empty if there is none, or if its nodes cannot be opened.
+std::vector<output> outputs();
+
+// Sets gamma through the GAMMA_LUT property of CRTCs, with atomic commits.
+// DRM master is only held for the length of a commit, never while a graphical session is active on the seat,
+// so that a compositor or display manager starting later never finds the device taken.
+class device {
+    int fd_;
+    struct queued {
+        uint32_t crtc_id;
+        uint32_t gamma_lut;
+        uint32_t blob_id;
+    };
+    std::vector<queued> queued_;
+    // First error while queueing, reported by the next commit.
+    int error_;
+public:
+    device(const std::string &path);
+    ~device();
+    device(device&&) = delete;
+
+    // Turn the ramps (all red values, then green, then blue) into a GAMMA_LUT blob for the next commit.
+    void queue_gamma(const output &out, std::span<const uint16_t> ramps);
+    // Apply everything queued in one atomic commit. Returns 0, or the errno of the failure:
+    // EBUSY, EACCES or EPERM while a graphical session or another client has the device.
+    int commit();
+};
+
+// True if the active session of seat0 is graphical (X11, Wayland or Mir): its compositor owns the outputs.
+bool graphical_session_active();
+
+// Reports changes of logind sessions and seats, such as VT switches, or sessions starting and ending.
+class session_monitor {
+    sd_login_monitor *monitor_;
+    int stop_fd_;
+public:
+    session_monitor();
+    ~session_monitor();
+    session_monitor(session_monitor&&) = delete;
+    // Block until the next change. Returns false if stop was requested instead.
+    bool wait(std::stop_token);
+};
+
+} // namespace drm
+} // namespace gummyd
+
+#endif // DRM_KMS_HPP
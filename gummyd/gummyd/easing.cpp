@@ -1,7 +1,7 @@
 // Copyright 2021-2024 Francesco Fusco <f.fusco@pm.me>
 // SPDX-License-Identifier: GPL-3.0-or-later
 
-#include <thread>
+#include <algorithm>
 #include <fmt/chrono.h>
 #include <spdlog/spdlog.h>
 
@@ -29,7 +29,7 @@ double ease_in_out_quad(double t) {
         return (-2 * t * t) + (4 * t) - 1;
 }
 
-int animate(int start, int end, int duration_ms, std::function<double(double t)> easing, std::function<void(int)> fn, std::function<bool()> interrupt) {
+int animate(int start, int end, int duration_ms, std::function<double(double t)> easing, std::function<void(int)> fn, std::function<bool(std::chrono::steady_clock::time_point)> wait) {
     if (start == end) {
         fn(end);
         return end;
@@ -38,33 +38,51 @@ int animate(int start, int end, int duration_ms, std::function<double(double t)>
     using namespace std::chrono;
     using namespace std::chrono_literals;
 
-    int cur = start;
-    int prev;
+    const nanoseconds animation_time((milliseconds(std::max(duration_ms, 0))));
+    const time_point<steady_clock> begin(steady_clock::now());
 
-    const nanoseconds animation_time((milliseconds(duration_ms)));
-    nanoseconds progress(0);
+    const auto value = [&] (double t) {
+        return int(lerp(start, end, std::min(easing(t), 1.)));
+    };
 
-    const time_point<steady_clock> begin(steady_clock::now());
+    // Wake-ups are placed within this much of the next value change.
+    const double resolution = animation_time.count() > 0 ? double(nanoseconds(1ms).count()) / animation_time.count() : 1.;
 
-    while (true) {
+    int cur = start;
+    size_t wakeups = 0;
 
-        prev = cur;
-        cur = lerp(start, end, std::min(easing(double(progress.count()) / animation_time.count()), 1.));
+    while (true) {
+        const nanoseconds progress = steady_clock::now() - begin;
+        const double t = animation_time.count() > 0 ? std::min(double(progress.count()) / animation_time.count(), 1.) : 1.;
 
-        if (prev != cur) {
+        if (const int val = value(t); val != cur) {
+            cur = val;
             SPDLOG_TRACE("[easing] cur: {}, progress {}/{}", cur, duration_cast<seconds>(progress), duration_cast<seconds>(animation_time));
             fn(cur);
         }
 
-        if (interrupt() || progress.count() >= animation_time.count()) {
+        if (t >= 1.)
             break;
+
+        // Bisect the earliest progress at which the value moves away from cur.
+        // If it never does, this is the end of the animation.
+        double lo = t;
+        double hi = 1.;
+        while (hi - lo > resolution) {
+            const double mid = lo + (hi - lo) / 2;
+            if (value(mid) != cur) {
+                hi = mid;
+            } else {
+                lo = mid;
+            }
         }
 
-        std::this_thread::sleep_for(1ms);
-        progress = (steady_clock::now() - begin);
+        ++wakeups;
+        if (wait(begin + duration_cast<nanoseconds>(animation_time * hi)))
+            break;
     }
 
-    spdlog::debug("[easing] animation over in {}", duration_cast<milliseconds>(steady_clock::now() - begin));
+    spdlog::debug("[easing] animation over in {} ({} wake-ups)", duration_cast<milliseconds>(steady_clock::now() - begin), wakeups);
     return cur;
 }
 
@@ -12,7 +12,10 @@ namespace easing {
 double ease(double t);
 double ease_out_expo(double t);
 double ease_in_out_quad(double t);
-int animate(int start, int end, int duration_ms, std::function<double(double t)> easing, std::function<void(int)> fn, std::function<bool()> interrupt);
+// Call fn with each new integer value between start and end, following the easing function, which must be non-decreasing.
+// Instead of polling, it sleeps until the next value is due by calling `wait(deadline)`,
+// which should return true as soon as the animation is interrupted, or false at the deadline.
+int animate(int start, int end, int duration_ms, std::function<double(double t)> easing, std::function<void(int)> fn, std::function<bool(std::chrono::steady_clock::time_point deadline)> wait);
 }
 }
 
@@ -0,0 +1,268 @@
+// Copyright 2021-2024 Francesco Fusco <f.fusco@pm.me>
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include <cerrno>
+#include <chrono>
+#include <algorithm>
+#include <condition_variable>
+#include <stdexcept>
+#include <spdlog/spdlog.h>
+
+#include <gummyd/gamma-backend.hpp>
+
+namespace gummyd {
+
+// Delay before asking again for gamma controls that another client holds, doubled each time.
+constexpr std::chrono::seconds wl_retry_min {1};
+constexpr std::chrono::seconds wl_retry_max {60};
+
+randr_gamma::randr_gamma(const std::vector<xcb::randr::output> &outputs)
+: outputs_(outputs) {
+}
+
+size_t randr_gamma::output_count() const {
+    return outputs_.size();
+}
+
+size_t randr_gamma::ramp_size(size_t idx) const {
+    return outputs_[idx].ramp_size;
+}
+
+double randr_gamma::refresh_rate(size_t idx) const {
+    return outputs_[idx].refresh_rate;
+}
+
+void randr_gamma::queue_gamma(size_t idx, const ramps &data) {
+    // The ramps are copied into the request, so they can be released before the flush.
+    xcb::randr::queue_gamma(connection_, outputs_[idx].crtc_id, *data);
+}
+
+size_t randr_gamma::flush() {
+    return xcb::randr::flush_gamma(connection_);
+}
+
+mutter_gamma::mutter_gamma(const std::vector<dbus::mutter::output> &outputs)
+: outputs_(outputs) {
+}
+
+size_t mutter_gamma::output_count() const {
+    return outputs_.size();
+}
+
+size_t mutter_gamma::ramp_size(size_t idx) const {
+    // Disconnected since startup.
+    return outputs_[idx].crtc < 0 ? 0 : outputs_[idx].ramp_size;
+}
+
+double mutter_gamma::refresh_rate(size_t idx) const {
+    return outputs_[idx].refresh_rate;
+}
+
+void mutter_gamma::queue_gamma(size_t idx, const ramps &data) {
+    display_config_.set_gamma(outputs_[idx].serial, outputs_[idx].crtc, data);
+}
+
+size_t mutter_gamma::flush() {
+    // Calls are sent as they come, only the errors are left.
+    return display_config_.take_errors();
+}
+
+void mutter_gamma::on_outputs_changed(std::function<void()> fn) {
+    display_config_.on_monitors_changed(std::move(fn));
+}
+
+bool mutter_gamma::update_outputs() {
+    // Through the long-lived proxy. Known outputs keep their ramp size, only new ones are asked for it.
+    const std::vector<dbus::mutter::output> current = display_config_.get_resources(outputs_);
+    if (current.empty()) {
+        spdlog::warn("[mutter] monitors changed, but no outputs were found");
+        return false;
+    }
+
+    // Screen indices stay as they were at startup. Outputs are matched by name and EDID,
+    // the ones that went away are left without a CRTC until they come back.
+    std::vector<dbus::mutter::output> outputs = outputs_;
+    for (size_t i = 0; i < outputs.size(); ++i) {
+        const auto it = std::ranges::find_if(current, [&] (const dbus::mutter::output &o) {
+            return o.name == outputs[i].name && o.edid == outputs[i].edid;
+        });
+        if (it != current.end()) {
+            outputs[i] = *it;
+        } else {
+            outputs[i].serial = current[0].serial;
+            outputs[i].crtc   = -1;
+        }
+        spdlog::info("[mutter] [screen {}] serial: {}, crtc: {}", i, outputs[i].serial, outputs[i].crtc);
+    }
+
+    outputs_.swap(outputs);
+    return true;
+}
+
+drm_gamma::drm_gamma(const std::vector<drm::output> &outputs)
+: device_(outputs.at(0).device),
+  outputs_(outputs),
+  paused_(false) {
+}
+
+size_t drm_gamma::output_count() const {
+    return outputs_.size();
+}
+
+size_t drm_gamma::ramp_size(size_t idx) const {
+    return paused_ ? 0 : outputs_[idx].ramp_size;
+}
+
+double drm_gamma::refresh_rate(size_t idx) const {
+    return outputs_[idx].refresh_rate;
+}
+
+void drm_gamma::queue_gamma(size_t idx, const ramps &data) {
+    device_.queue_gamma(outputs_[idx], *data);
+}
+
+size_t drm_gamma::flush() {
+    const int err = device_.commit();
+
+    // A compositor has the device. Retrying every frame would only fail again,
+    // so wait for the sessions to change (a VT switch, or the compositor's session ending).
+    if (err == EBUSY || err == EACCES || err == EPERM) {
+        spdlog::warn("[drm] the device is in use by a graphical session, gamma paused until the session changes");
+        paused_ = true;
+        watcher_ = std::jthread([this] (std::stop_token stoken) { watch(stoken); });
+    }
+
+    return err == 0 ? 0 : 1;
+}
+
+void drm_gamma::on_outputs_changed(std::function<void()> fn) {
+    on_resume_ = std::move(fn);
+}
+
+void drm_gamma::watch(std::stop_token stoken) {
+    try {
+        drm::session_monitor monitor;
+        if (!monitor.wait(stoken))
+            return;
+    } catch (const std::runtime_error &e) {
+        spdlog::error("[drm] {}, gamma stays paused", e.what());
+        return;
+    }
+
+    // Whether the device is free is only known by trying: the next commit pauses again if it is not.
+    spdlog::info("[drm] sessions changed, resuming gamma");
+    paused_ = false;
+    if (on_resume_)
+        on_resume_();
+}
+
+wl_gamma::wl_gamma(const std::vector<wl::gamma_output> &outputs)
+: outputs_(outputs),
+  retry_delay_(wl_retry_min),
+  retry_pending_(false) {
+    // Screen indices follow the order outputs were announced in when probing.
+    if (control_.outputs().size() != outputs.size())
+        throw std::runtime_error("wayland outputs changed during startup");
+}
+
+size_t wl_gamma::output_count() const {
+    return outputs_.size();
+}
+
+size_t wl_gamma::ramp_size(size_t idx) const {
+    // The compositor may hand out a control of another size after taking the previous one away.
+    return control_.ramp_size(idx);
+}
+
+double wl_gamma::refresh_rate(size_t idx) const {
+    return outputs_[idx].refresh_rate;
+}
+
+void wl_gamma::queue_gamma(size_t idx, const ramps &data) {
+    control_.queue_gamma(idx, *data);
+}
+
+size_t wl_gamma::flush() {
+    const size_t errors = control_.flush();
+    schedule_retry();
+    return errors;
+}
+
+void wl_gamma::on_outputs_changed(std::function<void()> fn) {
+    on_retry_ = std::move(fn);
+}
+
+bool wl_gamma::update_outputs() {
+    // Only the writer uses the display, so the retry itself happens here.
+    control_.retry();
+    schedule_retry();
+    return false;
+}
+
+void wl_gamma::schedule_retry() {
+    const size_t lost = control_.lost_outputs();
+    if (lost == 0) {
+        retry_delay_ = wl_retry_min;
+        return;
+    }
+    if (retry_pending_)
+        return;
+
+    spdlog::info("[gamma-control] {} output(s) without gamma control, asking again in {}s", lost, retry_delay_.count());
+    retry_pending_ = true;
+    retry_ = std::jthread([this, delay = retry_delay_] (std::stop_token stoken) {
+        std::mutex mutex;
+        std::unique_lock lock(mutex);
+        std::condition_variable_any().wait_for(lock, stoken, delay, [] { return false; });
+        if (stoken.stop_requested())
+            return;
+        retry_pending_ = false;
+        if (on_retry_)
+            on_retry_();
+    });
+    retry_delay_ = std::min(retry_delay_ * 2, wl_retry_max);
+}
+
+recording_gamma::recording_gamma(std::vector<size_t> ramp_sizes, double refresh_rate)
+: ramp_sizes_(std::move(ramp_sizes)),
+  refresh_rate_(refresh_rate),
+  last_(ramp_sizes_.size()),
+  stats_({0, 0, 0}) {
+}
+
+size_t recording_gamma::output_count() const {
+    return ramp_sizes_.size();
+}
+
+size_t recording_gamma::ramp_size(size_t idx) const {
+    return ramp_sizes_[idx];
+}
+
+double recording_gamma::refresh_rate(size_t) const {
+    return refresh_rate_;
+}
+
+void recording_gamma::queue_gamma(size_t idx, const ramps &data) {
+    std::lock_guard lock(mutex_);
+    last_[idx] = data;
+    stats_.uploads += 1;
+    stats_.bytes   += data->size() * sizeof(uint16_t);
+}
+
+size_t recording_gamma::flush() {
+    std::lock_guard lock(mutex_);
+    stats_.flushes += 1;
+    return 0;
+}
+
+recording_gamma::ramps recording_gamma::last_ramps(size_t idx) const {
+    std::lock_guard lock(mutex_);
+    return last_[idx];
+}
+
+recording_gamma::stats recording_gamma::get_stats() const {
+    std::lock_guard lock(mutex_);
+    return stats_;
+}
+
+} // namespace gummyd
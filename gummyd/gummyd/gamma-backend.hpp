@@ -0,0 +1,151 @@
+// Copyright 2021-2024 Francesco Fusco <f.fusco@pm.me>
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#ifndef GAMMA_BACKEND_HPP
+#define GAMMA_BACKEND_HPP
+
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <memory>
+#include <vector>
+#include <cstdint>
+#include <functional>
+
+#include <gummyd/x11-xcb.hpp>
+#include <gummyd/sd-dbus.hpp>
+#include <gummyd/drm-kms.hpp>
+#include <gummyd/wl-gamma-control.hpp>
+
+namespace gummyd {
+
+// Where gamma ramps go. Outputs are indexed like screens.
+// Only the gamma_state writer calls queue_gamma(), flush() and update_outputs().
+class gamma_backend {
+public:
+    using ramps = std::shared_ptr<const std::vector<uint16_t>>;
+
+    virtual ~gamma_backend() = default;
+
+    virtual size_t output_count() const = 0;
+    // 0 if the output cannot take ramps right now.
+    virtual size_t ramp_size(size_t idx) const = 0;
+    // In Hz, 0 if unknown.
+    virtual double refresh_rate(size_t idx) const = 0;
+
+    // Apply or queue the ramps (all red values, then green, then blue) of the output's ramp size.
+    virtual void queue_gamma(size_t idx, const ramps&) = 0;
+    // Send everything queued. Returns the number of errors since the previous call.
+    virtual size_t flush() = 0;
+
+    // Call fn, from any thread, when the display server reconfigured its outputs.
+    virtual void on_outputs_changed(std::function<void()>) {}
+    // Look up the outputs again after fn was called. Returns false if they could not be found.
+    virtual bool update_outputs() { return false; }
+};
+
+class randr_gamma : public gamma_backend {
+    xcb::connection connection_;
+    std::vector<xcb::randr::output> outputs_;
+public:
+    randr_gamma(const std::vector<xcb::randr::output>&);
+    size_t output_count() const override;
+    size_t ramp_size(size_t idx) const override;
+    double refresh_rate(size_t idx) const override;
+    void queue_gamma(size_t idx, const ramps&) override;
+    size_t flush() override;
+};
+
+class mutter_gamma : public gamma_backend {
+    dbus::mutter::display_config display_config_;
+    // Only the writer reads the table, so swapping it in update_outputs() is atomic with respect to uploads.
+    std::vector<dbus::mutter::output> outputs_;
+public:
+    mutter_gamma(const std::vector<dbus::mutter::output>&);
+    size_t output_count() const override;
+    size_t ramp_size(size_t idx) const override;
+    double refresh_rate(size_t idx) const override;
+    void queue_gamma(size_t idx, const ramps&) override;
+    size_t flush() override;
+    void on_outputs_changed(std::function<void()>) override;
+    bool update_outputs() override;
+};
+
+// Pauses while a graphical session or another client has the device,
+// and asks for every ramp again after the next logind session change.
+class drm_gamma : public gamma_backend {
+    drm::device device_;
+    std::vector<drm::output> outputs_;
+    std::atomic<bool> paused_;
+    std::function<void()> on_resume_;
+    // Runs while paused, waiting for a session change.
+    std::jthread watcher_;
+    void watch(std::stop_token);
+public:
+    drm_gamma(const std::vector<drm::output>&);
+    size_t output_count() const override;
+    // 0 on every output while paused.
+    size_t ramp_size(size_t idx) const override;
+    double refresh_rate(size_t idx) const override;
+    void queue_gamma(size_t idx, const ramps&) override;
+    size_t flush() override;
+    void on_outputs_changed(std::function<void()>) override;
+};
+
+// Outputs whose control another client took are asked for again after a growing delay.
+// The delay runs on its own thread, which then has the writer call update_outputs().
+class wl_gamma : public gamma_backend {
+    wl::gamma_control control_;
+    std::vector<wl::gamma_output> outputs_;
+    std::function<void()> on_retry_;
+    std::chrono::seconds retry_delay_;
+    std::atomic<bool> retry_pending_;
+    std::jthread retry_;
+    void schedule_retry();
+public:
+    wl_gamma(const std::vector<wl::gamma_output>&);
+    size_t output_count() const override;
+    size_t ramp_size(size_t idx) const override;
+    double refresh_rate(size_t idx) const override;
+    void queue_gamma(size_t idx, const ramps&) override;
+    size_t flush() override;
+    void on_outputs_changed(std::function<void()>) override;
+    // Asks again for the lost controls. The outputs themselves stay the same, so it returns false.
+    bool update_outputs() override;
+};
+
+// Keeps the ramps in memory instead of applying them.
+// For benchmarks and tests of the whole path to the upload, without a display server.
+class recording_gamma : public gamma_backend {
+public:
+    struct stats {
+        uint64_t uploads;
+        uint64_t bytes;
+        uint64_t flushes;
+    };
+
+    // One output for each ramp size. A refresh rate of 0 paces uploads at 60 Hz, like unknown rates.
+    recording_gamma(std::vector<size_t> ramp_sizes, double refresh_rate = 0.);
+    size_t output_count() const override;
+    size_t ramp_size(size_t idx) const override;
+    double refresh_rate(size_t idx) const override;
+    void queue_gamma(size_t idx, const ramps&) override;
+    size_t flush() override;
+
+    // Last ramps received for the output, null if none.
+    ramps last_ramps(size_t idx) const;
+    stats get_stats() const;
+
+private:
+    std::vector<size_t> ramp_sizes_;
+    double refresh_rate_;
+    // Written by the writer, read by whoever inspects the results.
+    mutable std::mutex mutex_;
+    std::vector<ramps> last_;
+    stats stats_;
+};
+
+} // namespace gummyd
+
+#endif // GAMMA_BACKEND_HPP
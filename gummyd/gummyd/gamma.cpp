@@ -2,106 +2,128 @@
 // SPDX-License-Identifier: GPL-3.0-or-later
 
 #include <array>
+#include <span>
+#include <stdexcept>
 #include <spdlog/spdlog.h>
 #include <sdbus-c++/IConnection.h>
 
-#include <gummyd/utils.hpp>
 #include <gummyd/gamma.hpp>
+#include <gummyd/kelvin.hpp>
 #include <gummyd/config.hpp>
 #include <gummyd/display.hpp>
 #include <gummyd/constants.hpp>
 #include <gummyd/sd-dbus.hpp>
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define GUMMYD_GAMMA_X86
+#endif
+
 using namespace gummyd;
 
+// At most 1.5 MB with 2048-entry ramps.
+constexpr size_t ramp_cache_capacity = 128;
+
+// Wait after the writer failed, doubled on each failure in a row.
+constexpr std::chrono::seconds writer_retry_min {1};
+constexpr std::chrono::seconds writer_retry_max {60};
+
+// FNV-1a.
+uint64_t fingerprint(const std::vector<uint16_t> &ramps) {
+    uint64_t hash = 0xcbf29ce484222325;
+    for (const uint16_t val : ramps) {
+        hash ^= val;
+        hash *= 0x100000001b3;
+    }
+    return hash;
+}
+
+ramp_cache::ramp_cache(size_t capacity)
+: capacity_(capacity),
+  stats_({0, 0}) {
+    map_.reserve(capacity);
+}
+
+ramp_cache::ramps ramp_cache::get(int brightness, int temperature, size_t ramp_size, std::vector<uint16_t> (*fn)(int, int, size_t)) {
+    // Sanitized settings fit in 16 bits each.
+    const uint64_t key = (uint64_t(ramp_size) << 32) | (uint64_t(uint16_t(brightness)) << 16) | uint16_t(temperature);
+
+    {
+        std::lock_guard lock(mutex_);
+        if (const auto it = map_.find(key); it != map_.end()) {
+            lru_.splice(lru_.begin(), lru_, it->second);
+            ++stats_.hits;
+            return it->second->second;
+        }
+        ++stats_.misses;
+    }
+
+    // Built outside of the lock. Two threads missing on the same key both build it, and the first one is kept.
+    std::vector<uint16_t> data = fn(brightness, temperature, ramp_size);
+    const uint64_t hash = fingerprint(data);
+    ramps val {std::make_shared<const std::vector<uint16_t>>(std::move(data)), hash};
+
+    std::lock_guard lock(mutex_);
+    if (const auto it = map_.find(key); it != map_.end()) {
+        lru_.splice(lru_.begin(), lru_, it->second);
+        return it->second->second;
+    }
+
+    if (lru_.size() >= capacity_) {
+        map_.erase(lru_.back().first);
+        lru_.pop_back();
+    }
+
+    lru_.emplace_front(key, val);
+    map_.emplace(key, lru_.begin());
+    return val;
+}
+
+ramp_cache::stats ramp_cache::get_stats() {
+    std::lock_guard lock(mutex_);
+    return stats_;
+}
+
 gamma_state::gamma_state(const std::vector<xcb::randr::output> &outputs)
-  : x_connection_(std::make_unique<xcb::connection>()),
-  randr_outputs_(outputs),
-  outputs_settings_(outputs.size(), default_settings) {
+: gamma_state(std::make_unique<randr_gamma>(outputs)) {
 }
 
 gamma_state::gamma_state(const std::vector<dbus::mutter::output> &outputs)
-: dbus_connection_(sdbus::createSessionBusConnection()),
-  mutter_outputs_(outputs),
-  outputs_settings_(outputs.size(), default_settings) {
-}
-
-// Color ramp by Ingo Thies.
-// From Redshift: https://github.com/jonls/redshift/blob/master/README-colorramp
-std::array<double, 3> kelvin_to_rgb(int val) {
-    constexpr size_t nrows (56);
-    constexpr size_t ncols (3);
-    constexpr std::array<double, nrows * ncols> ingo_thies_table {
-            1.00000000, 0.18172716, 0.00000000,
-            1.00000000, 0.25503671, 0.00000000,
-            1.00000000, 0.30942099, 0.00000000,
-            1.00000000, 0.35357379, 0.00000000,
-            1.00000000, 0.39091524, 0.00000000,
-            1.00000000, 0.42322816, 0.00000000,
-            1.00000000, 0.45159884, 0.00000000,
-            1.00000000, 0.47675916, 0.00000000,
-            1.00000000, 0.49923747, 0.00000000,
-            1.00000000, 0.51943421, 0.00000000,
-            1.00000000, 0.54360078, 0.08679949,
-            1.00000000, 0.56618736, 0.14065513,
-            1.00000000, 0.58734976, 0.18362641,
-            1.00000000, 0.60724493, 0.22137978,
-            1.00000000, 0.62600248, 0.25591950,
-            1.00000000, 0.64373109, 0.28819679,
-            1.00000000, 0.66052319, 0.31873863,
-            1.00000000, 0.67645822, 0.34786758,
-            1.00000000, 0.69160518, 0.37579588,
-            1.00000000, 0.70602449, 0.40267128,
-            1.00000000, 0.71976951, 0.42860152,
-            1.00000000, 0.73288760, 0.45366838,
-            1.00000000, 0.74542112, 0.47793608,
-            1.00000000, 0.75740814, 0.50145662,
-            1.00000000, 0.76888303, 0.52427322,
-            1.00000000, 0.77987699, 0.54642268,
-            1.00000000, 0.79041843, 0.56793692,
-            1.00000000, 0.80053332, 0.58884417,
-            1.00000000, 0.81024551, 0.60916971,
-            1.00000000, 0.81957693, 0.62893653,
-            1.00000000, 0.82854786, 0.64816570,
-            1.00000000, 0.83717703, 0.66687674,
-            1.00000000, 0.84548188, 0.68508786,
-            1.00000000, 0.85347859, 0.70281616,
-            1.00000000, 0.86118227, 0.72007777,
-            1.00000000, 0.86860704, 0.73688797,
-            1.00000000, 0.87576611, 0.75326132,
-            1.00000000, 0.88267187, 0.76921169,
-            1.00000000, 0.88933596, 0.78475236,
-            1.00000000, 0.89576933, 0.79989606,
-            1.00000000, 0.90198230, 0.81465502,
-            1.00000000, 0.90963069, 0.82838210,
-            1.00000000, 0.91710889, 0.84190889,
-            1.00000000, 0.92441842, 0.85523742,
-            1.00000000, 0.93156127, 0.86836903,
-            1.00000000, 0.93853986, 0.88130458,
-            1.00000000, 0.94535695, 0.89404470,
-            1.00000000, 0.95201559, 0.90658983,
-            1.00000000, 0.95851906, 0.91894041,
-            1.00000000, 0.96487079, 0.93109690,
-            1.00000000, 0.97107439, 0.94305985,
-            1.00000000, 0.97713351, 0.95482993,
-            1.00000000, 0.98305189, 0.96640795,
-            1.00000000, 0.98883326, 0.97779486,
-            1.00000000, 0.99448139, 0.98899179,
-            1.00000000, 1.00000000, 1.00000000,
-    };
-
-    const double idx_lerp (remap(val, constants::temp_k_min, constants::temp_k_max, 0, nrows - 1));
-    const size_t idx (std::floor(idx_lerp) * ncols);
-
-    if (idx >= ingo_thies_table.size() - ncols) {
-        return {1.,1.,1.};
-    }
+: gamma_state(std::make_unique<mutter_gamma>(outputs)) {
+}
+
+gamma_state::gamma_state(const std::vector<drm::output> &outputs)
+: gamma_state(std::make_unique<drm_gamma>(outputs)) {
+}
 
-    const size_t idx_next (idx + ncols);
-    const double r (lerp(ingo_thies_table[idx + 0], ingo_thies_table[idx_next + 0], mant(idx_lerp)));
-    const double g (lerp(ingo_thies_table[idx + 1], ingo_thies_table[idx_next + 1], mant(idx_lerp)));
-    const double b (lerp(ingo_thies_table[idx + 2], ingo_thies_table[idx_next + 2], mant(idx_lerp)));
-    return {r, g, b};
+gamma_state::gamma_state(const std::vector<wl::gamma_output> &outputs)
+: gamma_state(std::make_unique<wl_gamma>(outputs)) {
+}
+
+gamma_state::gamma_state(std::unique_ptr<gamma_backend> backend)
+: backend_(std::move(backend)),
+  outputs_settings_(backend_->output_count(), default_settings),
+  ramp_cache_(ramp_cache_capacity),
+  uploads_(backend_->output_count()),
+  dirty_(backend_->output_count(), dirty::CLEAN),
+  pending_(false),
+  monitors_changed_(false),
+  writer_([this] (std::stop_token stoken) { write(stoken); }) {
+    backend_->on_outputs_changed([this] {
+        {
+            std::lock_guard lock(writer_mutex_);
+            monitors_changed_ = true;
+            pending_ = true;
+        }
+        writer_cv_.notify_one();
+    });
+}
+
+std::chrono::nanoseconds gamma_state::frame_interval(double refresh_rate) {
+    // Unknown or implausible rates fall back to 60 Hz.
+    if (!(refresh_rate >= 1. && refresh_rate <= 1000.))
+        refresh_rate = 60.;
+    return std::chrono::nanoseconds(int64_t(1e9 / refresh_rate));
 }
 
 double calc_brt_scale(int step, size_t ramp_sz) {
@@ -109,49 +131,224 @@ double calc_brt_scale(int step, size_t ramp_sz) {
     return (double(step) / constants::brt_steps_max) * ramp_step;
 }
 
+namespace {
+
+using ramps_fn = void (*)(std::span<uint16_t> r, std::span<uint16_t> g, std::span<uint16_t> b, size_t begin, double brt_scale, const std::array<double, 3> &rgb_scale);
+
+void ramps_scalar(std::span<uint16_t> r, std::span<uint16_t> g, std::span<uint16_t> b, size_t begin, double brt_scale, const std::array<double, 3> &rgb_scale) {
+    for (size_t i = begin; i < r.size(); ++i) {
+        const int val (std::min(int(i * brt_scale), UINT16_MAX));
+        r[i] = uint16_t(val * rgb_scale[0]);
+        g[i] = uint16_t(val * rgb_scale[1]);
+        b[i] = uint16_t(val * rgb_scale[2]);
+    }
+}
+
+#ifdef GUMMYD_GAMMA_X86
+
+// Same operations as ramps_scalar, four double lanes at a time, so that the output is bit-exact.
+// Products are truncated just like the scalar casts, and every value fits in 16 bits.
+
+__attribute__((target("avx2")))
+inline __m128i channel_avx2(__m256d val_lo, __m256d val_hi, __m256d scale) {
+    return _mm_packus_epi32(_mm256_cvttpd_epi32(_mm256_mul_pd(val_lo, scale)),
+                            _mm256_cvttpd_epi32(_mm256_mul_pd(val_hi, scale)));
+}
+
+__attribute__((target("avx2")))
+void ramps_avx2(std::span<uint16_t> r, std::span<uint16_t> g, std::span<uint16_t> b, size_t begin, double brt_scale, const std::array<double, 3> &rgb_scale) {
+    const __m256d brt     = _mm256_set1_pd(brt_scale);
+    const __m256d scale_r = _mm256_set1_pd(rgb_scale[0]);
+    const __m256d scale_g = _mm256_set1_pd(rgb_scale[1]);
+    const __m256d scale_b = _mm256_set1_pd(rgb_scale[2]);
+    const __m256d step    = _mm256_set1_pd(8.);
+    const __m128i max     = _mm_set1_epi32(UINT16_MAX);
+
+    __m256d idx_lo = _mm256_add_pd(_mm256_set1_pd(double(begin)), _mm256_setr_pd(0., 1., 2., 3.));
+    __m256d idx_hi = _mm256_add_pd(idx_lo, _mm256_set1_pd(4.));
+
+    size_t i = begin;
+    for (; i + 8 <= r.size(); i += 8) {
+        const __m256d val_lo = _mm256_cvtepi32_pd(_mm_min_epi32(_mm256_cvttpd_epi32(_mm256_mul_pd(idx_lo, brt)), max));
+        const __m256d val_hi = _mm256_cvtepi32_pd(_mm_min_epi32(_mm256_cvttpd_epi32(_mm256_mul_pd(idx_hi, brt)), max));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(r.data() + i), channel_avx2(val_lo, val_hi, scale_r));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(g.data() + i), channel_avx2(val_lo, val_hi, scale_g));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(b.data() + i), channel_avx2(val_lo, val_hi, scale_b));
+        idx_lo = _mm256_add_pd(idx_lo, step);
+        idx_hi = _mm256_add_pd(idx_hi, step);
+    }
+
+    ramps_scalar(r, g, b, i, brt_scale, rgb_scale);
+}
+
+#endif // GUMMYD_GAMMA_X86
+
+ramps_fn ramps_kernel(isa set) {
+#ifdef GUMMYD_GAMMA_X86
+    if (set == isa::AVX2)
+        return ramps_avx2;
+#endif
+    // There is no SSE2 version.
+    return ramps_scalar;
+}
+
+} // namespace
+
 // The gamma ramp is a set of unsigned 16-bit values for each of the three color channels.
 // Ramp size varies on different systems.
 // Default values with ramp_sz = 2048 look like this for each channel:
 // [ 0, 32, 64, 96, ... UINT16_MAX - 32 ]
 // So, when ramp_sz = 2048, each value is increased in steps of 32,
 // When ramp_sz = 1024, it's 64, and so on.
-std::vector<uint16_t> gamma_state::create_ramps(gamma_state::settings settings, size_t sz) {
-    settings = gamma_state::sanitize(settings);
+std::vector<uint16_t> gamma_state::create_ramps(int brightness, int temperature, size_t sz) {
+    return create_ramps(best_isa(), brightness, temperature, sz);
+}
 
+std::vector<uint16_t> gamma_state::create_ramps(isa set, int brightness, int temperature, size_t sz) {
     std::vector<uint16_t> ramps (sz * 3);
     const std::span r (ramps.begin(), sz);
     const std::span g (r.end(), sz);
     const std::span b (g.end(), sz);
 
-    const double brt_scale (calc_brt_scale(settings.brightness, sz));
-    const auto   rgb_scale (kelvin_to_rgb(settings.temperature));
+    ramps_kernel(set)(r, g, b, 0, calc_brt_scale(brightness, sz), kelvin::to_rgb(temperature));
 
-    for (size_t i = 0; i < sz; ++i) {
-        const int val (std::min(int(i * brt_scale), UINT16_MAX));
-        r[i] = uint16_t(val * rgb_scale[0]);
-        g[i] = uint16_t(val * rgb_scale[1]);
-        b[i] = uint16_t(val * rgb_scale[2]);
+    return ramps;
+}
+
+void gamma_state::mark(size_t screen_index, dirty val) {
+    {
+        std::lock_guard lock(writer_mutex_);
+        dirty_[screen_index] = std::max(dirty_[screen_index], val);
+        pending_ = true;
     }
+    writer_cv_.notify_one();
+}
 
-    return ramps;
+void gamma_state::write(std::stop_token stoken) {
+    using clock = std::chrono::steady_clock;
+
+    update_frame_intervals();
+
+    // Outputs still waiting for their next frame are kept here between passes.
+    std::vector<dirty> outputs (dirty_.size(), dirty::CLEAN);
+    std::optional<clock::time_point> deadline;
+    bool reconfigure = false;
+    std::chrono::seconds retry = writer_retry_min;
+
+    while (true) {
+        {
+            std::unique_lock lock(writer_mutex_);
+            const auto ready = [&] { return pending_; };
+            if (deadline) {
+                writer_cv_.wait_until(lock, stoken, *deadline, ready);
+            } else {
+                writer_cv_.wait(lock, stoken, ready);
+            }
+            if (stoken.stop_requested())
+                return;
+            for (size_t i = 0; i < outputs.size(); ++i) {
+                outputs[i] = std::max(outputs[i], dirty_[i]);
+                dirty_[i] = dirty::CLEAN;
+            }
+            pending_ = false;
+            // Kept until it succeeds.
+            reconfigure |= std::exchange(monitors_changed_, false);
+        }
+
+        try {
+            if (reconfigure) {
+                // Query the outputs again, and drop what was uploaded with the old configuration.
+                if (backend_->update_outputs()) {
+                    update_frame_intervals();
+                    for (upload_state &upload : uploads_)
+                        upload.fingerprint.reset();
+                }
+                // Reapply the current settings everywhere, with the new serial.
+                outputs.assign(outputs.size(), dirty::FORCE);
+                reconfigure = false;
+            }
+
+            const clock::time_point now = clock::now();
+            deadline.reset();
+
+            bool queued = false;
+            for (size_t i = 0; i < outputs.size(); ++i) {
+                if (outputs[i] == dirty::CLEAN)
+                    continue;
+
+                // Already uploaded during this frame: wait for the next one, picking up later changes as well.
+                upload_state &upload = uploads_[i];
+                if (now < upload.next_frame) {
+                    deadline = std::min(deadline.value_or(upload.next_frame), upload.next_frame);
+                    continue;
+                }
+
+                if (gamma_state::upload(i, std::atomic_ref(outputs_settings_[i]).load(), outputs[i] == dirty::FORCE)) {
+                    upload.next_frame = now + upload.frame_interval;
+                    queued = true;
+                }
+                outputs[i] = dirty::CLEAN;
+            }
+            if (queued)
+                flush();
+
+            retry = writer_retry_min;
+        } catch (const std::exception &e) {
+            // The display server may come back: wait, then upload everything again.
+            spdlog::error("[gamma_state] writer error: {}, retrying in {}s", e.what(), retry.count());
+            outputs.assign(outputs.size(), dirty::FORCE);
+            deadline.reset();
+
+            std::unique_lock lock(writer_mutex_);
+            writer_cv_.wait_for(lock, stoken, retry, [] { return false; });
+            pending_ = true;
+            retry = std::min(retry * 2, writer_retry_max);
+        }
+    }
+}
+
+void gamma_state::update_frame_intervals() {
+    for (size_t i = 0; i < uploads_.size(); ++i) {
+        const double rate = backend_->refresh_rate(i);
+        uploads_[i].frame_interval = frame_interval(rate);
+        uploads_[i].next_frame     = {};
+        spdlog::debug("[gamma_state] [screen {}] refresh rate: {:.2f} Hz", i, rate);
+    }
 }
 
-void gamma_state::set(size_t screen_index, gamma_state::settings settings) {
+bool gamma_state::upload(size_t screen_index, gamma_state::settings settings, bool force) {
     SPDLOG_TRACE("[gamma_state] [screen {}] set(brt: {}, temp: {})", screen_index, settings.brightness, settings.temperature);
 
-    if (mutter_outputs_.size() > 0) {
-        return dbus::mutter::set_gamma(
-                    *dbus_connection_,
-                    mutter_outputs_[screen_index].serial,
-                    mutter_outputs_[screen_index].crtc,
-                    gamma_state::create_ramps(settings, mutter_outputs_[screen_index].ramp_size)
-        );
+    // Disconnected, or the ramp size could not be read.
+    const size_t sz = backend_->ramp_size(screen_index);
+    if (sz == 0)
+        return false;
+
+    settings = gamma_state::sanitize(settings);
+
+    const ramp_cache::ramps ramps = ramp_cache_.get(settings.brightness, settings.temperature, sz, create_ramps);
+
+    upload_state &upload = uploads_[screen_index];
+
+    if (!force && upload.fingerprint == ramps.fingerprint) {
+        upload.skipped.fetch_add(1, std::memory_order_relaxed);
+        return false;
     }
 
-    if (randr_outputs_.size() > 0) {
-        return xcb::randr::set_gamma(*x_connection_,
-                                     randr_outputs_[screen_index].crtc_id,
-                                     gamma_state::create_ramps(settings, randr_outputs_[screen_index].ramp_size));
+    upload.fingerprint = ramps.fingerprint;
+
+    backend_->queue_gamma(screen_index, ramps.data);
+    return true;
+}
+
+void gamma_state::flush() {
+    const size_t errors = backend_->flush();
+
+    // Errors are not tied to an output here, so every output gets uploaded again on its next frame.
+    if (errors > 0) {
+        std::lock_guard lock(writer_mutex_);
+        dirty_.assign(dirty_.size(), dirty::FORCE);
+        pending_ = true;
     }
 }
 
@@ -177,17 +374,17 @@ void gamma_state::store_temperature(size_t idx, int val) {
 
 void gamma_state::set_brightness(size_t idx, int val) {
     store_brightness(idx, val);
-    set(idx, std::atomic_ref(outputs_settings_[idx]).load());
+    mark(idx, dirty::DIRTY);
 }
 
 void gamma_state::set_temperature(size_t idx, int val) {
     store_temperature(idx, val);
-    set(idx, std::atomic_ref(outputs_settings_[idx]).load());
+    mark(idx, dirty::DIRTY);
 }
 
 void gamma_state::reset_gamma() {
     for (size_t i = 0; i < outputs_settings_.size(); ++i) {
-        set(i, std::atomic_ref(outputs_settings_[i]).load());
+        mark(i, dirty::FORCE);
     }
 }
 
@@ -195,7 +392,36 @@ std::vector<gamma_state::settings> gamma_state::get_settings() {
     return outputs_settings_;
 }
 
+size_t gamma_state::output_count() const {
+    return outputs_settings_.size();
+}
+
+ramp_cache::stats gamma_state::get_ramp_cache_stats() {
+    return ramp_cache_.get_stats();
+}
+
+std::vector<uint64_t> gamma_state::get_skipped_uploads() {
+    std::vector<uint64_t> out;
+    out.reserve(uploads_.size());
+    for (const upload_state &upload : uploads_)
+        out.push_back(upload.skipped.load(std::memory_order_relaxed));
+    return out;
+}
+
 gamma_state::~gamma_state() {
+    writer_.request_stop();
+    writer_.join();
+
+    // Restore the default ramps synchronously, now that the writer is gone.
     outputs_settings_.assign(outputs_settings_.size(), default_settings);
-    reset_gamma();
+    for (size_t i = 0; i < outputs_settings_.size(); ++i) {
+        upload(i, outputs_settings_[i], true);
+    }
+    flush();
+
+    const ramp_cache::stats stats = ramp_cache_.get_stats();
+    spdlog::debug("[gamma_state] ramp cache hits: {}, misses: {}", stats.hits, stats.misses);
+
+    // Before the members its callbacks refer to.
+    backend_.reset();
 }
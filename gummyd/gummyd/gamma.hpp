@@ -4,15 +4,56 @@
 #ifndef GAMMA_HPP
 #define GAMMA_HPP
 
-#include <sdbus-c++/IConnection.h>
+#include <list>
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <vector>
+#include <chrono>
+#include <thread>
+#include <optional>
+#include <cstdint>
+#include <condition_variable>
+#include <unordered_map>
 
-#include <gummyd/display.hpp>
+#include <gummyd/isa.hpp>
 #include <gummyd/config.hpp>
 #include <gummyd/constants.hpp>
-#include <gummyd/sd-dbus.hpp>
+#include <gummyd/gamma-backend.hpp>
 
 namespace gummyd {
 
+// Bounded LRU cache of finished gamma ramps, keyed by the sanitized settings and the ramp size.
+// Shared by every output, so outputs with the same ramp size reuse each other's ramps.
+class ramp_cache {
+public:
+    struct ramps {
+        std::shared_ptr<const std::vector<uint16_t>> data;
+        // Hash of the values. Different settings can produce identical ramps.
+        uint64_t fingerprint;
+    };
+
+    struct stats {
+        uint64_t hits;
+        uint64_t misses;
+    };
+
+    ramp_cache(size_t capacity);
+
+    // Return the cached ramps for the key, or build them with `fn` and cache the result.
+    ramps get(int brightness, int temperature, size_t ramp_size, std::vector<uint16_t> (*fn)(int, int, size_t));
+    stats get_stats();
+
+private:
+    using entry = std::pair<uint64_t, ramps>;
+
+    std::mutex mutex_;
+    size_t capacity_;
+    std::list<entry> lru_;
+    std::unordered_map<uint64_t, std::list<entry>::iterator> map_;
+    stats stats_;
+};
+
 class gamma_state {
 public:
     struct settings {
@@ -22,6 +63,10 @@ public:
 
     gamma_state(const std::vector<xcb::randr::output> &);
     gamma_state(const std::vector<dbus::mutter::output>&);
+    gamma_state(const std::vector<drm::output>&);
+    gamma_state(const std::vector<wl::gamma_output>&);
+    // Any other backend, such as recording_gamma to run without a display server.
+    gamma_state(std::unique_ptr<gamma_backend>);
     ~gamma_state();
     gamma_state(const gamma_state &) = delete;
     gamma_state(gamma_state &&) = delete;
@@ -32,8 +77,21 @@ public:
     void store_temperature(size_t screen_idx, int val);
     void set_temperature(size_t screen_idx, int val);
 
+    // The set_* functions and reset_gamma() only store the settings and mark the output dirty.
+    // A writer thread applies them, with a single flush per pass,
+    // and at most once per displayed frame on each output.
+
+    // Upload every ramp again, even if unchanged. For when the display server might have lost them.
     void reset_gamma();
     std::vector<settings> get_settings();
+    size_t output_count() const;
+    ramp_cache::stats get_ramp_cache_stats();
+    // Uploads skipped on each output because the ramps were identical to the last ones applied.
+    std::vector<uint64_t> get_skipped_uploads();
+
+    // Ramps for sanitized settings, with the kernel of an instruction set that must be supported.
+    // Every instruction set gives the same ramps.
+    static std::vector<uint16_t> create_ramps(isa, int brightness, int temperature, size_t sz);
 
 private:
     settings default_settings {
@@ -41,15 +99,42 @@ private:
         6500
     };
 
-    std::unique_ptr<xcb::connection> x_connection_;
-    std::unique_ptr<sdbus::IConnection> dbus_connection_;
-    std::vector<xcb::randr::output> randr_outputs_;
-    std::vector<dbus::mutter::output> mutter_outputs_;
+    std::unique_ptr<gamma_backend> backend_;
     std::vector<settings> outputs_settings_;
+    ramp_cache ramp_cache_;
 
-    std::vector<uint16_t> create_ramps(gamma_state::settings settings, size_t sz);
+    // Only touched by the writer, or after it stopped.
+    struct upload_state {
+        std::optional<uint64_t> fingerprint;
+        std::atomic<uint64_t> skipped = 0;
+        std::chrono::nanoseconds frame_interval;
+        std::chrono::steady_clock::time_point next_frame;
+    };
+    std::vector<upload_state> uploads_;
+
+    enum class dirty : uint8_t {
+        CLEAN,
+        DIRTY,
+        FORCE,
+    };
+    std::mutex writer_mutex_;
+    std::condition_variable_any writer_cv_;
+    std::vector<dirty> dirty_;
+    bool pending_;
+    bool monitors_changed_;
+
+    static std::vector<uint16_t> create_ramps(int brightness, int temperature, size_t sz);
     static gamma_state::settings sanitize(settings);
-    void set(size_t screen_idx, settings);
+    static std::chrono::nanoseconds frame_interval(double refresh_rate);
+    void mark(size_t screen_idx, dirty);
+    void write(std::stop_token);
+    void update_frame_intervals();
+    // Hand the ramps for the settings to the backend. Returns false if skipped.
+    bool upload(size_t screen_idx, settings, bool force);
+    // Flush the backend, and collect errors.
+    void flush();
+
+    std::jthread writer_;
 };
 }
 
@@ -1,6 +1,7 @@
 ﻿// Copyright 2021-2024 Francesco Fusco <f.fusco@pm.me>
 // SPDX-License-Identifier: GPL-3.0-or-later
 
+#include <map>
 #include <vector>
 #include <functional>
 #include <thread>
@@ -20,6 +21,8 @@
 #include <gummyd/config.hpp>
 #include <gummyd/display.hpp>
 #include <gummyd/gamma.hpp>
+#include <gummyd/drm-kms.hpp>
+#include <gummyd/wl-gamma-control.hpp>
 #include <gummyd/sd-sysfs-devices.hpp>
 #include <gummyd/constants.hpp>
 #include <gummyd/ddc.hpp>
@@ -31,9 +34,23 @@ std::optional<xcb::shared_image> shared_image(bool cond) {
     return cond ? std::optional<xcb::shared_image>(std::in_place) : std::nullopt;
 }
 
+// wlroots compositors can be captured through screencopy when X11 is not available.
+std::optional<wl::screencopy> screencopy(bool cond) {
+    if (!cond)
+        return std::nullopt;
+    try {
+        return std::optional<wl::screencopy>(std::in_place);
+    } catch (const std::runtime_error &e) {
+        spdlog::warn("[screencopy] {}", e.what());
+        return std::nullopt;
+    }
+}
+
 std::optional<gummyd::gamma_state> opt_gamma_state (
     const std::vector<gummyd::xcb::randr::output> &randr_outputs,
-    const std::vector<dbus::mutter::output> &mutter_outputs
+    const std::vector<dbus::mutter::output> &mutter_outputs,
+    const std::vector<drm::output> &drm_outputs,
+    const std::vector<wl::gamma_output> &wl_outputs
 ) {
     if (mutter_outputs.size() > 0) {
         return std::optional<gummyd::gamma_state>(std::in_place, mutter_outputs);
@@ -43,6 +60,22 @@ std::optional<gummyd::gamma_state> opt_gamma_state (
         return std::optional<gummyd::gamma_state>(std::in_place, randr_outputs);
     }
 
+    if (drm_outputs.size() > 0) {
+        try {
+            return std::optional<gummyd::gamma_state>(std::in_place, drm_outputs);
+        } catch (const std::runtime_error &e) {
+            spdlog::error("[drm] {}", e.what());
+        }
+    }
+
+    if (wl_outputs.size() > 0) {
+        try {
+            return std::optional<gummyd::gamma_state>(std::in_place, wl_outputs);
+        } catch (const std::runtime_error &e) {
+            spdlog::error("[gamma-control] {}", e.what());
+        }
+    }
+
     return std::nullopt;
 }
 
@@ -61,11 +94,32 @@ void run(std::vector<xcb::randr::output> &randr_outputs,
 
 	channel<double>    als_ch(-1.);
 	channel<time_data> time_ch({-1, -1, -1});
-    std::vector<channel<int>> screenlight_channels;
-    screenlight_channels.reserve(screenlight_clients);
+    std::map<size_t, channel<int>> screenlight_channels;
     std::vector<std::jthread> threads;
 
     std::optional shared_screen_image = shared_image(screenlight_clients > 0 && randr_outputs.size() > 0);
+    std::optional wl_screencopy = screencopy(screenlight_clients > 0 && randr_outputs.empty() && !gummyd::env("WAYLAND_DISPLAY").empty());
+
+    const size_t capture_outputs = wl_screencopy.has_value() ? wl_screencopy->output_count() : randr_outputs.size();
+
+    for (size_t idx = 0; idx < conf.screens.size(); ++idx) {
+        if (conf.clients_for(config::screen::mode::SCREENLIGHT, idx) > 0 && idx < capture_outputs) {
+            screenlight_channels.try_emplace(idx, -1);
+        }
+    }
+
+    if (!screenlight_channels.empty()) {
+        spdlog::debug("starting screenlight_server for {} screen(s)...", screenlight_channels.size());
+        if (wl_screencopy.has_value()) {
+            threads.emplace_back([&] {
+                screenlight_server(*wl_screencopy, screenlight_channels, conf.screenshot, stoken);
+            });
+        } else {
+            threads.emplace_back([&] {
+                screenlight_server(*shared_screen_image, randr_outputs, screenlight_channels, conf.screenshot, stoken);
+            });
+        }
+    }
 
 	if (time_clients > 0) {
         spdlog::debug("starting time_server...");
@@ -82,12 +136,6 @@ void run(std::vector<xcb::randr::output> &randr_outputs,
 	}
 
 	for (size_t idx = 0; idx < conf.screens.size(); ++idx) {
-        if (conf.clients_for(config::screen::mode::SCREENLIGHT, idx) > 0 && idx < randr_outputs.size()) {
-            spdlog::debug("[screen {}] starting screenlight server", idx);
-            screenlight_channels.emplace_back(-1);
-            threads.emplace_back(screenlight_server, std::ref(*shared_screen_image), std::ref(randr_outputs[idx]), std::ref(screenlight_channels.back()), conf.screenshot, stoken);
-		}
-
         using std::placeholders::_1;
         using enum config::screen::model_id;
         using enum config::screen::mode;
@@ -108,12 +156,13 @@ void run(std::vector<xcb::randr::output> &randr_outputs,
                     fn = std::bind(&ddc::display::set_brightness_step, &ddc_displays[idx], _1);
                 }
                 break;
+            // Screens can outnumber gamma outputs, for instance with DDC displays that match none.
             case BRIGHTNESS:
-                if (gamma_state.has_value() && conf.gamma.enabled)
+                if (gamma_state.has_value() && conf.gamma.enabled && idx < gamma_state->output_count())
                     fn = std::bind(&gamma_state::set_brightness, &gamma_state.value(), idx, _1);
                 break;
             case TEMPERATURE:
-                if (gamma_state.has_value() && conf.gamma.enabled)
+                if (gamma_state.has_value() && conf.gamma.enabled && idx < gamma_state->output_count())
                     fn = std::bind(&gamma_state::set_temperature, &gamma_state.value(), idx, _1);
                 break;
             }
@@ -134,12 +183,12 @@ void run(std::vector<xcb::randr::output> &randr_outputs,
                 threads.emplace_back(als_client, std::ref(als_ch), idx, model, fn, conf.als.adaptation_ms);
                 break;
             case SCREENLIGHT:
-                if (screenlight_channels.empty()) {
+                if (!screenlight_channels.contains(idx)) {
                     spdlog::warn("[{}] screenlight unavailable, skipping", scr_model_id);
                     break;
                 }
                 spdlog::debug("[{}] starting screenlight_client", scr_model_id);
-                threads.emplace_back(screenlight_client, std::ref(screenlight_channels.back()), idx, model, fn, conf.screenshot.adaptation_ms);
+                threads.emplace_back(screenlight_client, std::ref(screenlight_channels.at(idx)), idx, model, fn, conf.screenshot.adaptation_ms);
                 break;
             case TIME:
                 spdlog::debug("[{}] starting time_client", scr_model_id);
@@ -203,12 +252,35 @@ int init() {
         }
     }
 
-    // Will be empty if we are neither on X11 or Wayland/Mutter.
+    // wlroots compositors (sway, Hyprland...) take gamma tables from clients.
+    std::vector wl_outputs ([&] {
+        if (randr_outputs.empty() && mutter_outputs.empty() && !gummyd::env("WAYLAND_DISPLAY").empty()) {
+            return wl::gamma_outputs();
+        } else {
+            return std::vector<wl::gamma_output>();
+        }
+    }());
+
+    // Without X11, Mutter or wlroots (TTY, Weston, other compositors), gamma goes straight to KMS.
+    std::vector drm_outputs ([&] {
+        if (randr_outputs.empty() && mutter_outputs.empty() && wl_outputs.empty()) {
+            return drm::outputs();
+        } else {
+            return std::vector<drm::output>();
+        }
+    }());
+
+    // Will be empty if we are neither on X11, Wayland/Mutter, wlroots or KMS.
+    // DDC displays are matched to outputs by EDID, so that they share screen indices.
     std::vector<std::array<uint8_t, 128>> edids;
     if (randr_outputs.size() > 0) {
         std::ranges::transform(randr_outputs, std::back_inserter(edids), &xcb::randr::output::edid);
-    } else {
+    } else if (mutter_outputs.size() > 0) {
         std::ranges::transform(mutter_outputs, std::back_inserter(edids), &dbus::mutter::output::edid);
+    } else if (wl_outputs.size() > 0) {
+        std::ranges::transform(wl_outputs, std::back_inserter(edids), &wl::gamma_output::edid);
+    } else if (drm_outputs.size() > 0) {
+        std::ranges::transform(drm_outputs, std::back_inserter(edids), &drm::output::edid);
     }
 
     std::vector ddc_displays (ddc::get_displays(edids));
@@ -217,6 +289,8 @@ int init() {
 
     spdlog::info("[x11] found {} screen(s)", randr_outputs.size());
     spdlog::info("[dbus] found {} screen(s)", mutter_outputs.size());
+    spdlog::info("[gamma-control] found {} screen(s)", wl_outputs.size());
+    spdlog::info("[drm] found {} screen(s)", drm_outputs.size());
     spdlog::info("[sysfs] backlights: {}, als: {}", sysfs_backlights.size(), sysfs_als.size());
 
     if (ddc_displays.size() == 0) {
@@ -231,6 +305,10 @@ int init() {
             return randr_outputs.size();
         if (mutter_outputs.size() > 0)
             return mutter_outputs.size();
+        if (wl_outputs.size() > 0)
+            return wl_outputs.size();
+        if (drm_outputs.size() > 0)
+            return drm_outputs.size();
         if (sysfs_backlights.size() > 0)
             return sysfs_backlights.size();
         return 0ul;
@@ -259,7 +337,7 @@ int init() {
     }());
 
     gummyd::config conf (screen_count);
-    std::optional gamma_state (opt_gamma_state(randr_outputs, mutter_outputs));
+    std::optional gamma_state (opt_gamma_state(randr_outputs, mutter_outputs, drm_outputs, wl_outputs));
 
     while (true) {
 		std::jthread thr([&] (std::stop_token stoken) {
@@ -278,6 +356,23 @@ int init() {
                 }
             }();
 
+            const std::vector<uint64_t> gamma_skipped = [&gamma_state, &conf] {
+                if (gamma_state.has_value() && conf.gamma.enabled) {
+                    return gamma_state.value().get_skipped_uploads();
+                } else {
+                    return std::vector<uint64_t>();
+                }
+            }();
+
+            // Shared by every screen.
+            const std::optional<gummyd::ramp_cache::stats> ramp_cache_stats = [&gamma_state, &conf] {
+                if (gamma_state.has_value() && conf.gamma.enabled) {
+                    return std::optional(gamma_state.value().get_ramp_cache_stats());
+                } else {
+                    return std::optional<gummyd::ramp_cache::stats>();
+                }
+            }();
+
             using enum config::screen::model_id;
 
             nlohmann::json out;
@@ -292,19 +387,29 @@ int init() {
                     return -1;
                 } ();
                 out[idx]["brt"] = [&] {
-                    if (!gamma_settings.empty()) {
+                    if (idx < gamma_settings.size()) {
                         return gamma_settings[idx].brightness / 10;
                     } else {
                         return -1;
                     }
                 } ();
                 out[idx]["temp"] = [&] {
-                    if (!gamma_settings.empty()) {
+                    if (idx < gamma_settings.size()) {
                         return gamma_settings[idx].temperature;
                     } else {
                         return -1;
                     }
                 } ();
+                out[idx]["gamma_skipped"] = [&] {
+                    // Screens past the gamma outputs (DDC or backlight only) have no count.
+                    if (idx < gamma_skipped.size()) {
+                        return int64_t(gamma_skipped[idx]);
+                    } else {
+                        return int64_t(-1);
+                    }
+                } ();
+                out[idx]["ramp_cache_hits"]   = ramp_cache_stats.has_value() ? int64_t(ramp_cache_stats->hits) : int64_t(-1);
+                out[idx]["ramp_cache_misses"] = ramp_cache_stats.has_value() ? int64_t(ramp_cache_stats->misses) : int64_t(-1);
                 out[idx]["bl_mode"]   = conf.screens[idx].models[size_t(BACKLIGHT)].mode;
                 out[idx]["brt_mode"]  = conf.screens[idx].models[size_t(BRIGHTNESS)].mode;
                 out[idx]["temp_mode"] = conf.screens[idx].models[size_t(TEMPERATURE)].mode;
@@ -0,0 +1,47 @@
+// Copyright 2021-2024 Francesco Fusco <f.fusco@pm.me>
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#ifndef ISA_HPP
+#define ISA_HPP
+
+namespace gummyd {
+
+// Instruction sets that kernels have versions for.
+// The best supported one is used at runtime, the others can be asked for to compare results.
+enum class isa {
+    SCALAR,
+    SSE2,
+    AVX2,
+};
+
+inline bool isa_supported(isa set) {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    switch (set) {
+    case isa::SCALAR:
+        return true;
+    case isa::SSE2:
+        return __builtin_cpu_supports("sse2");
+    case isa::AVX2:
+        return __builtin_cpu_supports("avx2");
+    }
+    return false;
+#else
+    return set == isa::SCALAR;
+#endif
+}
+
+inline isa best_isa() {
+    static const isa best = [] {
+        for (const isa set : {isa::AVX2, isa::SSE2}) {
+            if (isa_supported(set))
+                return set;
+        }
+        return isa::SCALAR;
+    }();
+    return best;
+}
+
+} // namespace gummyd
+
+#endif // ISA_HPP
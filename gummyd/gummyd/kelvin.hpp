@@ -0,0 +1,129 @@
+// Copyright 2021-2024 Francesco Fusco <f.fusco@pm.me>
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#ifndef KELVIN_HPP
+#define KELVIN_HPP
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <algorithm>
+
+namespace gummyd {
+namespace kelvin {
+
+constexpr int min = 1000;
+constexpr int max = 6500;
+
+namespace detail {
+
+// Color ramp by Ingo Thies.
+// From Redshift: https://github.com/jonls/redshift/blob/master/README-colorramp
+// Rows go from 1000 K to 6500 K, in 100 K steps.
+constexpr size_t nrows (56);
+constexpr size_t ncols (3);
+inline constexpr std::array<double, nrows * ncols> ingo_thies_table {
+            1.00000000, 0.18172716, 0.00000000,
+            1.00000000, 0.25503671, 0.00000000,
+            1.00000000, 0.30942099, 0.00000000,
+            1.00000000, 0.35357379, 0.00000000,
+            1.00000000, 0.39091524, 0.00000000,
+            1.00000000, 0.42322816, 0.00000000,
+            1.00000000, 0.45159884, 0.00000000,
+            1.00000000, 0.47675916, 0.00000000,
+            1.00000000, 0.49923747, 0.00000000,
+            1.00000000, 0.51943421, 0.00000000,
+            1.00000000, 0.54360078, 0.08679949,
+            1.00000000, 0.56618736, 0.14065513,
+            1.00000000, 0.58734976, 0.18362641,
+            1.00000000, 0.60724493, 0.22137978,
+            1.00000000, 0.62600248, 0.25591950,
+            1.00000000, 0.64373109, 0.28819679,
+            1.00000000, 0.66052319, 0.31873863,
+            1.00000000, 0.67645822, 0.34786758,
+            1.00000000, 0.69160518, 0.37579588,
+            1.00000000, 0.70602449, 0.40267128,
+            1.00000000, 0.71976951, 0.42860152,
+            1.00000000, 0.73288760, 0.45366838,
+            1.00000000, 0.74542112, 0.47793608,
+            1.00000000, 0.75740814, 0.50145662,
+            1.00000000, 0.76888303, 0.52427322,
+            1.00000000, 0.77987699, 0.54642268,
+            1.00000000, 0.79041843, 0.56793692,
+            1.00000000, 0.80053332, 0.58884417,
+            1.00000000, 0.81024551, 0.60916971,
+            1.00000000, 0.81957693, 0.62893653,
+            1.00000000, 0.82854786, 0.64816570,
+            1.00000000, 0.83717703, 0.66687674,
+            1.00000000, 0.84548188, 0.68508786,
+            1.00000000, 0.85347859, 0.70281616,
+            1.00000000, 0.86118227, 0.72007777,
+            1.00000000, 0.86860704, 0.73688797,
+            1.00000000, 0.87576611, 0.75326132,
+            1.00000000, 0.88267187, 0.76921169,
+            1.00000000, 0.88933596, 0.78475236,
+            1.00000000, 0.89576933, 0.79989606,
+            1.00000000, 0.90198230, 0.81465502,
+            1.00000000, 0.90963069, 0.82838210,
+            1.00000000, 0.91710889, 0.84190889,
+            1.00000000, 0.92441842, 0.85523742,
+            1.00000000, 0.93156127, 0.86836903,
+            1.00000000, 0.93853986, 0.88130458,
+            1.00000000, 0.94535695, 0.89404470,
+            1.00000000, 0.95201559, 0.90658983,
+            1.00000000, 0.95851906, 0.91894041,
+            1.00000000, 0.96487079, 0.93109690,
+            1.00000000, 0.97107439, 0.94305985,
+            1.00000000, 0.97713351, 0.95482993,
+            1.00000000, 0.98305189, 0.96640795,
+            1.00000000, 0.98883326, 0.97779486,
+            1.00000000, 0.99448139, 0.98899179,
+            1.00000000, 1.00000000, 1.00000000,
+    };
+
+// Same operations as the runtime remap, lerp and mant, so that table values match them bit for bit.
+constexpr double lerp_ct(double a, double b, double t) {
+    return (b * t) + (a * (1. - t));
+}
+
+constexpr double floor(double x) {
+    // Only called with non-negative values.
+    return double(uint64_t(x));
+}
+
+constexpr std::array<double, 3> interpolate(int val) {
+    const double t (double(val - min) / double(max - min));
+    const double idx_lerp (lerp_ct(0., double(nrows - 1), t));
+    const size_t idx (size_t(floor(idx_lerp)) * ncols);
+
+    if (idx >= ingo_thies_table.size() - ncols) {
+        return {1.,1.,1.};
+    }
+
+    const double frac (idx_lerp - floor(idx_lerp));
+    const size_t idx_next (idx + ncols);
+    return {
+        lerp_ct(ingo_thies_table[idx + 0], ingo_thies_table[idx_next + 0], frac),
+        lerp_ct(ingo_thies_table[idx + 1], ingo_thies_table[idx_next + 1], frac),
+        lerp_ct(ingo_thies_table[idx + 2], ingo_thies_table[idx_next + 2], frac),
+    };
+}
+
+} // namespace detail
+
+// RGB scale for every Kelvin value in [min, max], at 1 K resolution.
+inline constexpr std::array<std::array<double, 3>, max - min + 1> table = [] {
+    std::array<std::array<double, 3>, max - min + 1> out {};
+    for (int k = min; k <= max; ++k)
+        out[k - min] = detail::interpolate(k);
+    return out;
+}();
+
+constexpr const std::array<double, 3> &to_rgb(int val) {
+    return table[std::clamp(val, min, max) - min];
+}
+
+} // namespace kelvin
+} // namespace gummyd
+
+#endif // KELVIN_HPP
@@ -0,0 +1,521 @@
+// Copyright 2021-2024 Francesco Fusco <f.fusco@pm.me>
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include <span>
+#include <bit>
+#include <cmath>
+#include <climits>
+#include <cstring>
+#include <limits>
+#include <random>
+#include <numeric>
+#include <algorithm>
+#include <cstdint>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define GUMMYD_LUMINANCE_X86
+#endif
+
+#include <gummyd/luminance.hpp>
+
+namespace gummyd {
+namespace luminance {
+
+namespace {
+
+// Rec. 709 coefficients scaled by 2^15, so that they fit in signed 16-bit lanes.
+// They add up to exactly 32768.
+constexpr uint32_t weight_r = 6966;
+constexpr uint32_t weight_g = 23436;
+constexpr uint32_t weight_b = 2366;
+constexpr int      weight_shift = 15;
+constexpr uint32_t weight_round = 1 << (weight_shift - 1);
+
+static_assert(weight_r + weight_g + weight_b == (1 << weight_shift));
+
+inline uint32_t luma(uint32_t r, uint32_t g, uint32_t b) {
+    return (r * weight_r + g * weight_g + b * weight_b + weight_round) >> weight_shift;
+}
+
+// 8-bit channels at fixed byte offsets.
+template <size_t bpp, size_t r, size_t g, size_t b>
+struct byte_format {
+    static constexpr size_t bytes_per_pixel = bpp;
+    static constexpr size_t offset_r = r;
+    static constexpr size_t offset_g = g;
+    static constexpr size_t offset_b = b;
+
+    static uint32_t luma(const uint8_t *px) {
+        return luminance::luma(px[r], px[g], px[b]);
+    }
+};
+
+// Channels packed in a native-endian word, rounded to 8 bits.
+template <class word, int shift_r, int bits_r, int shift_g, int bits_g, int shift_b, int bits_b>
+struct packed_format {
+    static constexpr size_t bytes_per_pixel = sizeof(word);
+
+    template <int shift, int bits>
+    static uint32_t channel(word w) {
+        constexpr uint32_t max = (1u << bits) - 1;
+        return ((uint32_t(w >> shift) & max) * 255 + max / 2) / max;
+    }
+
+    static uint32_t luma(const uint8_t *px) {
+        word w;
+        std::memcpy(&w, px, sizeof(w));
+        return luminance::luma(channel<shift_r, bits_r>(w), channel<shift_g, bits_g>(w), channel<shift_b, bits_b>(w));
+    }
+};
+
+using bgrx32      = byte_format<4, 2, 1, 0>;
+using rgbx32      = byte_format<4, 0, 1, 2>;
+using xrgb32      = byte_format<4, 1, 2, 3>;
+using xbgr32      = byte_format<4, 3, 2, 1>;
+using bgr24       = byte_format<3, 2, 1, 0>;
+using rgb24       = byte_format<3, 0, 1, 2>;
+using x2r10g10b10 = packed_format<uint32_t, 20, 10, 10, 10, 0, 10>;
+using x2b10g10r10 = packed_format<uint32_t, 0, 10, 10, 10, 20, 10>;
+using r5g6b5      = packed_format<uint16_t, 11, 5, 5, 6, 0, 5>;
+
+// Consecutive pixels go to different copies of the histogram, which are merged at the end.
+// This avoids stalling on back-to-back increments of the same bin in flat areas.
+using sub_histograms = std::array<histogram, 4>;
+
+template <class F>
+void rows_scalar(const uint8_t *buf, size_t pitch, size_t width, size_t height, sub_histograms &sub) {
+    constexpr size_t bpp = F::bytes_per_pixel;
+    for (size_t y = 0; y < height; ++y) {
+        const uint8_t *row = buf + y * pitch;
+        size_t x = 0;
+        for (; x + 4 <= width; x += 4) {
+            ++sub[0][F::luma(row + (x + 0) * bpp)];
+            ++sub[1][F::luma(row + (x + 1) * bpp)];
+            ++sub[2][F::luma(row + (x + 2) * bpp)];
+            ++sub[3][F::luma(row + (x + 3) * bpp)];
+        }
+        for (; x < width; ++x) {
+            ++sub[0][F::luma(row + x * bpp)];
+        }
+    }
+}
+
+#ifdef GUMMYD_LUMINANCE_X86
+
+// 32bpp byte formats only. Bytes are widened to 16-bit lanes, four per pixel.
+// pmaddwd against the weights laid out at each channel's offset leaves two partial sums per pixel,
+// which are then added together to get the weighted luma.
+
+template <class F>
+constexpr bool simd_format = F::bytes_per_pixel == 4 && requires { F::offset_r; };
+
+template <class F>
+constexpr int64_t packed_weights = int64_t(weight_r) << (16 * F::offset_r)
+                                 | int64_t(weight_g) << (16 * F::offset_g)
+                                 | int64_t(weight_b) << (16 * F::offset_b);
+
+template <class F>
+__attribute__((target("avx2")))
+void rows_avx2(const uint8_t *buf, size_t pitch, size_t width, size_t height, sub_histograms &sub) {
+    const __m256i weights = _mm256_set1_epi64x(packed_weights<F>);
+    const __m256i round   = _mm256_set1_epi32(weight_round);
+    const __m256i zero    = _mm256_setzero_si256();
+    alignas(32) uint32_t l[8];
+
+    for (size_t y = 0; y < height; ++y) {
+        const uint8_t *row = buf + y * pitch;
+        size_t x = 0;
+        for (; x + 8 <= width; x += 8) {
+            const __m256i px = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(row + x * 4));
+            // Pixels 0, 1 | 4, 5 and 2, 3 | 6, 7. hadd puts them back in order.
+            const __m256i lo = _mm256_madd_epi16(_mm256_unpacklo_epi8(px, zero), weights);
+            const __m256i hi = _mm256_madd_epi16(_mm256_unpackhi_epi8(px, zero), weights);
+            const __m256i sum = _mm256_hadd_epi32(lo, hi);
+            _mm256_store_si256(reinterpret_cast<__m256i*>(l), _mm256_srli_epi32(_mm256_add_epi32(sum, round), weight_shift));
+            ++sub[0][l[0]];
+            ++sub[1][l[1]];
+            ++sub[2][l[2]];
+            ++sub[3][l[3]];
+            ++sub[0][l[4]];
+            ++sub[1][l[5]];
+            ++sub[2][l[6]];
+            ++sub[3][l[7]];
+        }
+        for (; x < width; ++x) {
+            ++sub[0][F::luma(row + x * 4)];
+        }
+    }
+}
+
+template <class F>
+void rows_sse2(const uint8_t *buf, size_t pitch, size_t width, size_t height, sub_histograms &sub) {
+    const __m128i weights = _mm_set1_epi64x(packed_weights<F>);
+    const __m128i round   = _mm_set1_epi32(weight_round);
+    const __m128i zero    = _mm_setzero_si128();
+    alignas(16) uint32_t lo_l[4];
+    alignas(16) uint32_t hi_l[4];
+
+    // Without phaddd, the two partial sums of each pixel are added with a 64-bit shift.
+    // The results end up in lanes 0 and 2.
+    const auto pair_sum = [&] (__m128i v) {
+        const __m128i m = _mm_madd_epi16(v, weights);
+        return _mm_srli_epi32(_mm_add_epi32(_mm_add_epi32(m, _mm_srli_epi64(m, 32)), round), weight_shift);
+    };
+
+    for (size_t y = 0; y < height; ++y) {
+        const uint8_t *row = buf + y * pitch;
+        size_t x = 0;
+        for (; x + 4 <= width; x += 4) {
+            const __m128i px = _mm_loadu_si128(reinterpret_cast<const __m128i*>(row + x * 4));
+            _mm_store_si128(reinterpret_cast<__m128i*>(lo_l), pair_sum(_mm_unpacklo_epi8(px, zero)));
+            _mm_store_si128(reinterpret_cast<__m128i*>(hi_l), pair_sum(_mm_unpackhi_epi8(px, zero)));
+            ++sub[0][lo_l[0]];
+            ++sub[1][lo_l[2]];
+            ++sub[2][hi_l[0]];
+            ++sub[3][hi_l[2]];
+        }
+        for (; x < width; ++x) {
+            ++sub[0][F::luma(row + x * 4)];
+        }
+    }
+}
+
+#endif // GUMMYD_LUMINANCE_X86
+
+using rows_fn = void (*)(const uint8_t*, size_t, size_t, size_t, sub_histograms&);
+
+struct kernel {
+    size_t bytes_per_pixel;
+    rows_fn rows;
+};
+
+// Formats without a SIMD version use the scalar one.
+template <class F>
+kernel make_kernel([[maybe_unused]] isa set) {
+#ifdef GUMMYD_LUMINANCE_X86
+    if constexpr (simd_format<F>) {
+        if (set == isa::AVX2)
+            return {F::bytes_per_pixel, rows_avx2<F>};
+        if (set == isa::SSE2)
+            return {F::bytes_per_pixel, rows_sse2<F>};
+    }
+#endif
+    return {F::bytes_per_pixel, rows_scalar<F>};
+}
+
+// In the order of pixel_format.
+std::array<kernel, 9> make_kernels(isa set) {
+    return {
+        make_kernel<bgrx32>(set),
+        make_kernel<rgbx32>(set),
+        make_kernel<xrgb32>(set),
+        make_kernel<xbgr32>(set),
+        make_kernel<bgr24>(set),
+        make_kernel<rgb24>(set),
+        make_kernel<x2r10g10b10>(set),
+        make_kernel<x2b10g10r10>(set),
+        make_kernel<r5g6b5>(set),
+    };
+}
+
+const kernel &kernel_for(isa set, pixel_format fmt) {
+    static const std::array kernels {
+        make_kernels(isa::SCALAR),
+        make_kernels(isa::SSE2),
+        make_kernels(isa::AVX2),
+    };
+    static_assert(kernels[0].size() == size_t(pixel_format::R5G6B5) + 1);
+    return kernels[size_t(set)][size_t(fmt)];
+}
+
+void merge(const sub_histograms &sub, histogram &hist) {
+    for (size_t i = 0; i < hist.size(); ++i) {
+        hist[i] += sub[0][i] + sub[1][i] + sub[2][i] + sub[3][i];
+    }
+}
+
+} // namespace
+
+std::optional<pixel_format> find_pixel_format(unsigned bits_per_pixel, uint32_t red_mask, uint32_t green_mask, uint32_t blue_mask, bool msb_first) {
+    using enum pixel_format;
+    const bool native = msb_first == (std::endian::native == std::endian::big);
+
+    const auto masks = [&] (uint32_t r, uint32_t g, uint32_t b) {
+        return red_mask == r && green_mask == g && blue_mask == b;
+    };
+
+    // Byte formats only depend on where each byte lands in memory.
+    switch (bits_per_pixel) {
+    case 32:
+        if (masks(0xff0000, 0xff00, 0xff))
+            return msb_first ? XRGB32 : BGRX32;
+        if (masks(0xff, 0xff00, 0xff0000))
+            return msb_first ? XBGR32 : RGBX32;
+        if (native && masks(0x3ff00000, 0xffc00, 0x3ff))
+            return X2R10G10B10;
+        if (native && masks(0x3ff, 0xffc00, 0x3ff00000))
+            return X2B10G10R10;
+        break;
+    case 24:
+        if (masks(0xff0000, 0xff00, 0xff))
+            return msb_first ? RGB24 : BGR24;
+        if (masks(0xff, 0xff00, 0xff0000))
+            return msb_first ? BGR24 : RGB24;
+        break;
+    case 16:
+        if (native && masks(0xf800, 0x7e0, 0x1f))
+            return R5G6B5;
+        break;
+    }
+
+    return std::nullopt;
+}
+
+size_t bytes_per_pixel(pixel_format fmt) {
+    return kernel_for(isa::SCALAR, fmt).bytes_per_pixel;
+}
+
+void histogram_pixels(pixel_format fmt, std::span<const uint8_t> buf, size_t pitch, rect r, histogram &hist) {
+    histogram_pixels(best_isa(), fmt, buf, pitch, r, hist);
+}
+
+void histogram_pixels(isa set, pixel_format fmt, std::span<const uint8_t> buf, size_t pitch, rect r, histogram &hist) {
+    const kernel &k = kernel_for(set, fmt);
+
+    if (r.w <= 0 || r.h <= 0)
+        return;
+
+    const size_t first = r.y * pitch + r.x * k.bytes_per_pixel;
+    const size_t row_bytes = r.w * k.bytes_per_pixel;
+    if (first + row_bytes > buf.size())
+        return;
+
+    // Only the rows that fit in the buffer.
+    const size_t rows = std::min(size_t(r.h), (buf.size() - first - row_bytes) / pitch + 1);
+
+    sub_histograms sub {};
+    k.rows(buf.data() + first, pitch, r.w, rows, sub);
+    merge(sub, hist);
+}
+
+int mean(const histogram &hist) {
+    uint64_t n = 0;
+    uint64_t sum = 0;
+    for (size_t i = 0; i < hist.size(); ++i) {
+        n   += hist[i];
+        sum += hist[i] * i;
+    }
+    return n > 0 ? int((sum + n / 2) / n) : 0;
+}
+
+int percentile(const histogram &hist, double p) {
+    const uint64_t n = std::accumulate(hist.begin(), hist.end(), uint64_t(0));
+    if (n == 0)
+        return 0;
+
+    const uint64_t target = std::max(uint64_t(1), uint64_t(std::ceil(std::clamp(p, 0., 1.) * n)));
+    uint64_t count = 0;
+    for (size_t i = 0; i < hist.size(); ++i) {
+        count += hist[i];
+        if (count >= target)
+            return i;
+    }
+    return hist.size() - 1;
+}
+
+int median(const histogram &hist) {
+    return percentile(hist, 0.5);
+}
+
+int apl(const histogram &hist) {
+    static const std::array<double, 256> linear = [] {
+        std::array<double, 256> ret;
+        for (size_t i = 0; i < ret.size(); ++i) {
+            const double v = i / 255.;
+            ret[i] = v <= 0.04045 ? v / 12.92 : std::pow((v + 0.055) / 1.055, 2.4);
+        }
+        return ret;
+    }();
+
+    uint64_t n = 0;
+    double sum = 0;
+    for (size_t i = 0; i < hist.size(); ++i) {
+        n   += hist[i];
+        sum += hist[i] * linear[i];
+    }
+
+    if (n == 0)
+        return 0;
+
+    const double v = sum / n;
+    const double encoded = v <= 0.0031308 ? v * 12.92 : 1.055 * std::pow(v, 1 / 2.4) - 0.055;
+    return int(std::lround(std::clamp(encoded, 0., 1.) * 255));
+}
+
+std::vector<rect> patches(rect area, size_t count, int size) {
+    // Candidates tried for each new patch. More gives a more even spread.
+    constexpr size_t candidates = 16;
+
+    std::vector<rect> ret;
+    if (area.w < size || area.h < size || count == 0)
+        return ret;
+
+    std::mt19937 rng(0x9e3779b9);
+    std::uniform_int_distribution<int> dist_x(area.x, area.x + area.w - size);
+    std::uniform_int_distribution<int> dist_y(area.y, area.y + area.h - size);
+
+    ret.reserve(count);
+    while (ret.size() < count) {
+        rect best {};
+        int64_t best_dist = -1;
+
+        // Keep the candidate farthest from every patch placed so far.
+        for (size_t i = 0; i < candidates; ++i) {
+            const rect c {dist_x(rng), dist_y(rng), size, size};
+            int64_t nearest = std::numeric_limits<int64_t>::max();
+            for (const rect &p : ret) {
+                const int64_t dx = c.x - p.x;
+                const int64_t dy = c.y - p.y;
+                nearest = std::min(nearest, dx * dx + dy * dy);
+            }
+            if (nearest > best_dist) {
+                best = c;
+                best_dist = nearest;
+            }
+        }
+
+        ret.push_back(best);
+    }
+
+    return ret;
+}
+
+tile_grid::tile_grid(rect area, int tile_size, pixel_format format)
+    : area_(area),
+      tile_size_(tile_size),
+      format_(format),
+      cols_((area.w + tile_size - 1) / tile_size),
+      rows_((area.h + tile_size - 1) / tile_size),
+      hists_(cols_ * rows_),
+      dirty_(cols_ * rows_, true) {
+}
+
+rect tile_grid::tile(int col, int row) const {
+    const int x = area_.x + col * tile_size_;
+    const int y = area_.y + row * tile_size_;
+    return {
+        x,
+        y,
+        std::min(tile_size_, area_.x + area_.w - x),
+        std::min(tile_size_, area_.y + area_.h - y),
+    };
+}
+
+void tile_grid::mark(rect r) {
+    const int x0 = std::max(r.x, area_.x);
+    const int y0 = std::max(r.y, area_.y);
+    const int x1 = std::min(r.x + r.w, area_.x + area_.w);
+    const int y1 = std::min(r.y + r.h, area_.y + area_.h);
+
+    if (x0 >= x1 || y0 >= y1)
+        return;
+
+    for (int row = (y0 - area_.y) / tile_size_; row <= (y1 - 1 - area_.y) / tile_size_; ++row) {
+        for (int col = (x0 - area_.x) / tile_size_; col <= (x1 - 1 - area_.x) / tile_size_; ++col) {
+            dirty_[row * cols_ + col] = true;
+        }
+    }
+}
+
+void tile_grid::mark_all() {
+    dirty_.assign(dirty_.size(), true);
+}
+
+void tile_grid::clear() {
+    dirty_.assign(dirty_.size(), false);
+}
+
+bool tile_grid::dirty() const {
+    return std::ranges::find(dirty_, true) != dirty_.end();
+}
+
+tile_grid::capture tile_grid::take() {
+    int x0 = INT_MAX, y0 = INT_MAX, x1 = INT_MIN, y1 = INT_MIN;
+    for (int row = 0; row < rows_; ++row) {
+        for (int col = 0; col < cols_; ++col) {
+            if (!dirty_[row * cols_ + col])
+                continue;
+            const rect t = tile(col, row);
+            x0 = std::min(x0, t.x);
+            y0 = std::min(y0, t.y);
+            x1 = std::max(x1, t.x + t.w);
+            y1 = std::max(y1, t.y + t.h);
+        }
+    }
+
+    capture ret {std::vector<bool>(dirty_.size(), false), {0, 0, 0, 0}};
+    ret.tiles.swap(dirty_);
+    if (x0 < x1)
+        ret.area = {x0, y0, x1 - x0, y1 - y0};
+    return ret;
+}
+
+void tile_grid::restore(const capture &c) {
+    for (size_t idx = 0; idx < dirty_.size(); ++idx) {
+        if (c.tiles[idx])
+            dirty_[idx] = true;
+    }
+}
+
+std::vector<size_t> tile_grid::update_tiles(const std::vector<bool> &which, std::span<const uint8_t> buf, rect buf_area, size_t pitch, worker_pool &pool) {
+    std::vector<size_t> jobs;
+    for (int row = 0; row < rows_; ++row) {
+        for (int col = 0; col < cols_; ++col) {
+            const size_t idx = row * cols_ + col;
+            if (!which[idx])
+                continue;
+
+            const rect t = tile(col, row);
+            if (t.x < buf_area.x || t.y < buf_area.y
+            || t.x + t.w > buf_area.x + buf_area.w
+            || t.y + t.h > buf_area.y + buf_area.h)
+                continue;
+
+            jobs.push_back(idx);
+        }
+    }
+
+    // Tiles are small enough to stay in cache, and each one owns its histogram.
+    pool.run(jobs.size(), [&] (size_t i) {
+        const size_t idx = jobs[i];
+        const rect t = tile(idx % cols_, idx / cols_);
+        hists_[idx].fill(0);
+        histogram_pixels(format_, buf, pitch, {t.x - buf_area.x, t.y - buf_area.y, t.w, t.h}, hists_[idx]);
+    });
+
+    return jobs;
+}
+
+void tile_grid::update(std::span<const uint8_t> buf, rect buf_area, size_t pitch, worker_pool &pool) {
+    // std::vector<bool> packs bits, so flags are only written from this thread.
+    for (size_t idx : update_tiles(dirty_, buf, buf_area, pitch, pool))
+        dirty_[idx] = false;
+}
+
+void tile_grid::update(const capture &c, std::span<const uint8_t> buf, rect buf_area, size_t pitch, worker_pool &pool) {
+    update_tiles(c.tiles, buf, buf_area, pitch, pool);
+}
+
+histogram tile_grid::merged() const {
+    histogram ret {};
+    for (const histogram &h : hists_) {
+        for (size_t i = 0; i < ret.size(); ++i) {
+            ret[i] += h[i];
+        }
+    }
+    return ret;
+}
+
+} // namespace luminance
+} // namespace gummyd
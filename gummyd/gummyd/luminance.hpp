@@ -0,0 +1,119 @@
+// Copyright 2021-2024 Francesco Fusco <f.fusco@pm.me>
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#ifndef LUMINANCE_HPP
+#define LUMINANCE_HPP
+
+#include <span>
+#include <array>
+#include <vector>
+#include <optional>
+#include <cstdint>
+#include <cstddef>
+
+#include <gummyd/isa.hpp>
+#include <gummyd/worker-pool.hpp>
+
+namespace gummyd {
+namespace luminance {
+
+struct rect {
+    int x;
+    int y;
+    int w;
+    int h;
+};
+
+// Pixel count for each Rec. 709 luma value.
+using histogram = std::array<uint32_t, 256>;
+
+// Layouts of captured pixels. 8-bit formats are named after their bytes in memory,
+// packed formats after the bits of a native-endian word, most significant first.
+enum class pixel_format {
+    BGRX32,
+    RGBX32,
+    XRGB32,
+    XBGR32,
+    BGR24,
+    RGB24,
+    X2R10G10B10,
+    X2B10G10R10,
+    R5G6B5,
+};
+
+// Format matching an image's bits per pixel, visual masks and byte order, if supported.
+std::optional<pixel_format> find_pixel_format(unsigned bits_per_pixel, uint32_t red_mask, uint32_t green_mask, uint32_t blue_mask, bool msb_first);
+
+size_t bytes_per_pixel(pixel_format);
+
+// Add the pixels of `r`, inside a buffer whose rows are `pitch` bytes apart.
+// Each format has its own kernel. 32bpp byte formats use AVX2 or SSE2 when available.
+void histogram_pixels(pixel_format fmt, std::span<const uint8_t> buf, size_t pitch, rect r, histogram &hist);
+
+// Same, with the kernels of an instruction set that must be supported.
+// Every instruction set gives the same histogram.
+void histogram_pixels(isa set, pixel_format fmt, std::span<const uint8_t> buf, size_t pitch, rect r, histogram &hist);
+
+// Metrics derived from a histogram, all in [0, 255].
+int mean(const histogram &);
+int median(const histogram &);
+// Smallest luma value that a `p` fraction of the pixels do not exceed.
+int percentile(const histogram &, double p);
+// Average picture level: mean light output, averaged in linear light
+// and encoded back with the sRGB transfer function.
+int apl(const histogram &);
+
+// `count` squares of side `size` spread evenly but irregularly over `area` (blue noise),
+// by best-candidate sampling with a fixed seed, so the same area always gives the same patches.
+std::vector<rect> patches(rect area, size_t count, int size);
+
+// Splits a screen area into square tiles and caches their histograms,
+// so that only the tiles touched by damage need to be read again.
+class tile_grid {
+    rect area_;
+    int tile_size_;
+    pixel_format format_;
+    int cols_;
+    int rows_;
+    std::vector<histogram> hists_;
+    std::vector<bool> dirty_;
+    rect tile(int col, int row) const;
+    // Recompute the tiles flagged in `which` that lie within `buf_area`. Returns their indices.
+    std::vector<size_t> update_tiles(const std::vector<bool> &which, std::span<const uint8_t> buf, rect buf_area, size_t pitch, worker_pool &pool);
+public:
+    // Dirty tiles handed over to a capture that has not arrived yet.
+    struct capture {
+        std::vector<bool> tiles;
+        // Covers every tile of the capture, empty if there is none.
+        rect area;
+    };
+
+    tile_grid(rect area, int tile_size, pixel_format format = pixel_format::BGRX32);
+
+    // Mark the tiles overlapping `r` (in the same coordinates as the area).
+    void mark(rect r);
+    void mark_all();
+    // Forget pending damage without reading it.
+    void clear();
+    bool dirty() const;
+
+    // Hand the dirty tiles over to a capture and clear them.
+    // Damage marked from now on is left for the next capture.
+    capture take();
+    // Mark the tiles of a capture that failed dirty again.
+    void restore(const capture &);
+
+    // Recompute the dirty tiles found within `buf_area`, spread over `pool`.
+    // `buf` holds the pixels of `buf_area`, rows are `pitch` bytes apart.
+    void update(std::span<const uint8_t> buf, rect buf_area, size_t pitch, worker_pool &pool);
+    // Same for the tiles of a capture taken earlier, whose pixels are in `buf`.
+    void update(const capture &, std::span<const uint8_t> buf, rect buf_area, size_t pitch, worker_pool &pool);
+
+    // Histogram of the whole area.
+    histogram merged() const;
+};
+
+} // namespace luminance
+} // namespace gummyd
+
+#endif // LUMINANCE_HPP
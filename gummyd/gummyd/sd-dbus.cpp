@@ -3,6 +3,7 @@
 
 #include <string>
 #include <functional>
+#include <algorithm>
 #include <span>
 
 #include <spdlog/spdlog.h>
@@ -36,16 +37,13 @@ std::unique_ptr<sdbus::IProxy> on_system_sleep(std::function<void(sdbus::Signal
             fn);
 }
 
-size_t mutter::get_gamma_ramp_size(sdbus::IConnection &conn, uint32_t serial, uint32_t crtc) {
+size_t mutter::get_gamma_ramp_size(sdbus::IProxy &proxy, uint32_t serial, uint32_t crtc) {
     std::tuple<std::vector<uint16_t>, std::vector<uint16_t>, std::vector<uint16_t>> reply;
     {
-        const std::string destination ("org.gnome.Mutter.DisplayConfig");
-        const std::string object_path ("/org/gnome/Mutter/DisplayConfig");
         const std::string interface   ("org.gnome.Mutter.DisplayConfig");
         const std::string method      ("GetCrtcGamma");
         try {
-            auto proxy (sdbus::createProxy(conn, sdbus::ServiceName{ destination }, sdbus::ObjectPath{ object_path }));
-            proxy->callMethod(method).onInterface(interface).withArguments(serial, crtc).storeResultsTo(reply);
+            proxy.callMethod(method).onInterface(interface).withArguments(serial, crtc).storeResultsTo(reply);
         } catch (const sdbus::Error &e) {
             spdlog::error(e.what());
         }
@@ -62,6 +60,19 @@ size_t mutter::get_gamma_ramp_size(sdbus::IConnection &conn, uint32_t serial, ui
 // outputs:         a(uxi au s au au a{sv})
 // modes:           a(uxu udu)
 std::vector<mutter::output> mutter::display_config_get_resources() {
+    const std::string destination ("org.gnome.Mutter.DisplayConfig");
+    const std::string object_path ("/org/gnome/Mutter/DisplayConfig");
+    try {
+        const auto connection (sdbus::createSessionBusConnection());
+        const auto proxy (sdbus::createProxy(*connection, sdbus::ServiceName{ destination }, sdbus::ObjectPath{ object_path }));
+        return mutter::get_resources(*proxy);
+    } catch (const sdbus::Error &e) {
+        spdlog::error(e.what());
+        return {};
+    }
+}
+
+std::vector<mutter::output> mutter::get_resources(sdbus::IProxy &proxy, const std::vector<mutter::output> &known) {
     using au   = std::vector<uint32_t>;
     using a_sv = std::map<std::string, sdbus::Variant>;
     using crtc_t   = sdbus::Struct<uint32_t, int64_t, int32_t, int32_t, int32_t, int32_t, int32_t, uint32_t, au, a_sv>;
@@ -70,16 +81,11 @@ std::vector<mutter::output> mutter::display_config_get_resources() {
 
     std::tuple<uint32_t, std::vector<crtc_t>, std::vector<output_t>, std::vector<mode_t>, int32_t, int32_t> reply;
 
-    const auto connection (sdbus::createSessionBusConnection());
-
     {
-        const std::string destination ("org.gnome.Mutter.DisplayConfig");
-        const std::string object_path ("/org/gnome/Mutter/DisplayConfig");
         const std::string interface   ("org.gnome.Mutter.DisplayConfig");
         const std::string method      ("GetResources");
         try {
-            auto proxy (sdbus::createProxy(*connection, sdbus::ServiceName{ destination }, sdbus::ObjectPath{ object_path }));
-            proxy->callMethod(method).onInterface(interface).withArguments().storeResultsTo(reply);
+            proxy.callMethod(method).onInterface(interface).withArguments().storeResultsTo(reply);
         } catch (const sdbus::Error &e) {
             spdlog::error(e.what());
             return {};
@@ -102,9 +108,25 @@ std::vector<mutter::output> mutter::display_config_get_resources() {
         mutter::output out;
         out.serial     = serial;
         out.crtc       = output.get<2>();
-        out.ramp_size  = mutter::get_gamma_ramp_size(*connection, out.serial, out.crtc);
         out.name       = properties.at("display-name").get<std::string>();
         std::copy_n(edid.begin(), 128, out.edid.begin());
+        out.ramp_size  = [&] () -> size_t {
+            if (out.crtc < 0)
+                return 0;
+            const auto it = std::ranges::find_if(known, [&] (const mutter::output &o) {
+                return o.name == out.name && o.edid == out.edid && o.ramp_size > 0;
+            });
+            return it != known.end() ? it->ramp_size : mutter::get_gamma_ramp_size(proxy, out.serial, out.crtc);
+        }();
+        out.refresh_rate = [&] {
+            // Mutter uses array indices as CRTC and mode IDs.
+            if (out.crtc < 0 || size_t(out.crtc) >= crtcs.size())
+                return 0.;
+            const int32_t mode = crtcs[out.crtc].get<6>();
+            if (mode < 0 || size_t(mode) >= modes.size())
+                return 0.;
+            return modes[mode].get<4>();
+        }();
 
         out_vec.push_back(out);
     }
@@ -112,25 +134,94 @@ std::vector<mutter::output> mutter::display_config_get_resources() {
     return out_vec;
 }
 
-void mutter::set_gamma(sdbus::IConnection &conn, uint32_t serial, uint32_t crtc, std::vector<uint16_t> ramps) {
+mutter::display_config::display_config()
+    : connection_(sdbus::createSessionBusConnection()),
+      errors_(0) {
     const std::string destination ("org.gnome.Mutter.DisplayConfig");
     const std::string object_path ("/org/gnome/Mutter/DisplayConfig");
-    const std::string interface   ("org.gnome.Mutter.DisplayConfig");
-    const std::string method      ("SetCrtcGamma");
+    proxy_ = sdbus::createProxy(*connection_, sdbus::ServiceName{ destination }, sdbus::ObjectPath{ object_path });
+    // Replies are dispatched on the connection's own event loop thread.
+    connection_->enterEventLoopAsync();
+}
+
+mutter::display_config::~display_config() {
+    wait_idle(std::chrono::milliseconds(1000));
+    proxy_.reset();
+    connection_->leaveEventLoop();
+}
+
+void mutter::display_config::send(uint32_t crtc, crtc_slot &slot, uint32_t serial, ramps data) {
+    const std::string interface ("org.gnome.Mutter.DisplayConfig");
+    const std::string method    ("SetCrtcGamma");
 
-    const size_t sz (ramps.size() / 3);
-    const std::span r (ramps.begin(), sz);
+    const size_t sz (data->size() / 3);
+    const std::span r (data->begin(), sz);
     const std::span g (r.end(), sz);
     const std::span b (g.end(), sz);
 
+    slot.in_flight = true;
+
     try {
-        const auto proxy (sdbus::createProxy(conn, sdbus::ServiceName{ destination }, sdbus::ObjectPath{ object_path }));
-        proxy->callMethod(method).onInterface(interface).withArguments(std::tuple{serial, crtc, r, g, b});
+        // The arguments are serialized here, the ramps are not needed past this call.
+        proxy_->callMethodAsync(method).onInterface(interface).withArguments(serial, crtc, r, g, b).uponReplyInvoke([this, crtc] (std::optional<sdbus::Error> err) {
+            if (err) {
+                spdlog::error("[mutter] [set_gamma] crtc {}: {}", crtc, err->what());
+                errors_.fetch_add(1, std::memory_order_relaxed);
+            }
+
+            std::lock_guard lock(mutex_);
+            crtc_slot &slot = crtcs_[crtc];
+            slot.in_flight = false;
+            if (slot.next) {
+                send(crtc, slot, slot.serial, std::move(slot.next));
+                slot.next.reset();
+            }
+            if (!slot.in_flight)
+                idle_cv_.notify_all();
+        });
     } catch (const sdbus::Error &e) {
         spdlog::error("[mutter] [set_gamma] {} ", e.what());
+        errors_.fetch_add(1, std::memory_order_relaxed);
+        slot.in_flight = false;
     }
 }
 
+void mutter::display_config::set_gamma(uint32_t serial, uint32_t crtc, ramps data) {
+    std::lock_guard lock(mutex_);
+    crtc_slot &slot = crtcs_[crtc];
+
+    if (slot.in_flight) {
+        slot.serial = serial;
+        slot.next   = std::move(data);
+        return;
+    }
+
+    send(crtc, slot, serial, std::move(data));
+}
+
+std::vector<mutter::output> mutter::display_config::get_resources(const std::vector<mutter::output> &known) {
+    return mutter::get_resources(*proxy_, known);
+}
+
+void mutter::display_config::on_monitors_changed(std::function<void()> fn) {
+    const std::string interface ("org.gnome.Mutter.DisplayConfig");
+    const std::string signal    ("MonitorsChanged");
+    proxy_->registerSignalHandler(sdbus::InterfaceName{interface}, sdbus::SignalName{signal}, [fn] (sdbus::Signal) {
+        fn();
+    });
+}
+
+void mutter::display_config::wait_idle(std::chrono::milliseconds timeout) {
+    std::unique_lock lock(mutex_);
+    idle_cv_.wait_for(lock, timeout, [&] {
+        return std::ranges::none_of(crtcs_, [] (const auto &kv) { return kv.second.in_flight; });
+    });
+}
+
+size_t mutter::display_config::take_errors() {
+    return errors_.exchange(0, std::memory_order_relaxed);
+}
+
 void test_method_call() {
     const std::string destination ("org.gnome.Mutter.DisplayConfig");
     const std::string object_path ("/org/gnome/Mutter/IdleMonitor");
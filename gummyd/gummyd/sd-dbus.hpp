@@ -4,8 +4,15 @@
 #ifndef SD_DBUS_HPP
 #define SD_DBUS_HPP
 
+#include <map>
+#include <mutex>
+#include <atomic>
+#include <chrono>
 #include <string>
+#include <vector>
+#include <memory>
 #include <functional>
+#include <condition_variable>
 #include <sdbus-c++/IProxy.h>
 
 namespace gummyd {
@@ -27,10 +34,53 @@ struct output {
     std::string name;
     int crtc;
     size_t ramp_size;
+    // In Hz, 0 if unknown.
+    double refresh_rate;
 };
+// GetResources on a connection of its own.
 std::vector<mutter::output> display_config_get_resources();
-size_t get_gamma_ramp_size(sdbus::IConnection&, uint32_t serial, uint32_t crtc);
-void   set_gamma(sdbus::IConnection&, uint32_t serial, uint32_t crtc, std::vector<uint16_t> ramps);
+// GetResources through `proxy`. Outputs found in `known` with the same name and EDID keep their ramp size,
+// GetCrtcGamma is only called for the others.
+std::vector<mutter::output> get_resources(sdbus::IProxy &proxy, const std::vector<mutter::output> &known = {});
+size_t get_gamma_ramp_size(sdbus::IProxy&, uint32_t serial, uint32_t crtc);
+
+// Long-lived proxy to org.gnome.Mutter.DisplayConfig, on its own connection and event loop thread.
+// SetCrtcGamma calls are asynchronous, with at most one in flight for each CRTC.
+// Ramps set while a call is in flight wait for it to complete, replacing any other ramps still waiting.
+class display_config {
+    using ramps = std::shared_ptr<const std::vector<uint16_t>>;
+
+    struct crtc_slot {
+        bool in_flight = false;
+        uint32_t serial;
+        ramps next;
+    };
+
+    std::unique_ptr<sdbus::IConnection> connection_;
+    std::unique_ptr<sdbus::IProxy> proxy_;
+    std::mutex mutex_;
+    std::condition_variable idle_cv_;
+    std::map<uint32_t, crtc_slot> crtcs_;
+    std::atomic<size_t> errors_;
+
+    // Call with mutex_ held.
+    void send(uint32_t crtc, crtc_slot &slot, uint32_t serial, ramps);
+public:
+    display_config();
+    ~display_config();
+    display_config(display_config&&) = delete;
+
+    void set_gamma(uint32_t serial, uint32_t crtc, ramps);
+    // get_resources() through this proxy.
+    std::vector<mutter::output> get_resources(const std::vector<mutter::output> &known);
+    // Call fn from the event loop thread each time the monitor configuration changes.
+    // Serials and CRTCs from earlier GetResources calls are stale after that.
+    void on_monitors_changed(std::function<void()> fn);
+    // Wait until no call is in flight or waiting, for at most `timeout`.
+    void wait_idle(std::chrono::milliseconds timeout);
+    // Failed calls since the previous call.
+    size_t take_errors();
+};
 } // namespace mutter
 
 void test_method_call();
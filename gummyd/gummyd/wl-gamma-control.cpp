@@ -0,0 +1,335 @@
+// Copyright 2021-2024 Francesco Fusco <f.fusco@pm.me>
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include <algorithm>
+#include <filesystem>
+#include <cerrno>
+#include <cstring>
+#include <utility>
+#include <stdexcept>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <spdlog/spdlog.h>
+#include <wayland-client.h>
+#include <wlr-gamma-control-unstable-v1-client-protocol.h>
+#include <gummyd/wl-gamma-control.hpp>
+#include <gummyd/file.hpp>
+
+namespace gummyd {
+namespace wl {
+
+namespace {
+
+// wlroots names outputs after their DRM connectors, which list their EDID in sysfs (as in card0-DP-1/edid).
+std::array<uint8_t, 128> connector_edid(const std::string &name) {
+    std::array<uint8_t, 128> ret {};
+    if (name.empty())
+        return ret;
+
+    std::error_code ec;
+    for (const auto &entry : std::filesystem::directory_iterator("/sys/class/drm", ec)) {
+        const std::string dir = entry.path().filename().string();
+        if (!dir.starts_with("card") || !dir.ends_with("-" + name))
+            continue;
+
+        try {
+            const std::string edid = file_read(entry.path() / "edid");
+            if (edid.size() >= ret.size()) {
+                std::copy_n(edid.begin(), ret.size(), ret.begin());
+                return ret;
+            }
+        } catch (const std::exception &e) {
+            spdlog::debug("[gamma-control] {}: {}", dir, e.what());
+        }
+    }
+
+    spdlog::debug("[gamma-control] {}: edid not found", name);
+    return ret;
+}
+
+} // namespace
+
+gamma_control::output::~output() {
+    release_control();
+    if (fd >= 0)
+        close(fd);
+    if (wl_output)
+        wl_output_destroy(wl_output);
+}
+
+void gamma_control::output::create_control() {
+    static const zwlr_gamma_control_v1_listener listener {
+        .gamma_size = [] (void *data, zwlr_gamma_control_v1*, uint32_t size) {
+            output &o = *static_cast<output*>(data);
+            o.ramp_size = size;
+            o.lost      = false;
+        },
+        .failed = [] (void *data, zwlr_gamma_control_v1*) {
+            output &o = *static_cast<output*>(data);
+            o.failed = true;
+            // A control asked for again that fails before taking any table is still held by someone else.
+            // Counting it would have it asked for again on every frame.
+            if (o.ramp_size > 0) {
+                spdlog::warn("[gamma-control] {}: gamma control lost", o.name);
+                ++o.parent->failures_;
+            }
+        },
+    };
+
+    failed  = false;
+    control = zwlr_gamma_control_manager_v1_get_gamma_control(parent->manager_, wl_output);
+    zwlr_gamma_control_v1_add_listener(control, &listener, this);
+}
+
+void gamma_control::output::release_control() {
+    if (control) {
+        zwlr_gamma_control_v1_destroy(control);
+        control = nullptr;
+    }
+}
+
+bool gamma_control::output::write_table(std::span<const uint16_t> ramps) {
+    const size_t bytes = ramps.size_bytes();
+
+    // The table is kept as long as the gamma size stays the same.
+    if (fd < 0 || table_size != ramp_size) {
+        if (fd >= 0)
+            close(fd);
+
+        fd = memfd_create("gummyd-gamma", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+        if (fd < 0 || ftruncate(fd, bytes) < 0) {
+            spdlog::error("[gamma-control] shared memory allocation failed: {}", std::strerror(errno));
+            if (fd >= 0)
+                close(fd);
+            fd = -1;
+            return false;
+        }
+
+        // A table of the wrong size is a protocol error, so the size is fixed for good.
+        fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL);
+        table_size = ramp_size;
+    }
+
+    if (pwrite(fd, ramps.data(), bytes, 0) != ssize_t(bytes)) {
+        spdlog::error("[gamma-control] {}: table write failed: {}", name, std::strerror(errno));
+        return false;
+    }
+
+    // The compositor's copy of the descriptor shares the file offset, and it may read the table instead of mapping it.
+    lseek(fd, 0, SEEK_SET);
+    return true;
+}
+
+gamma_control::gamma_control()
+    : display_(wl_display_connect(nullptr)),
+      registry_(nullptr),
+      manager_(nullptr),
+      failures_(0),
+      started_(false) {
+    if (!display_)
+        throw std::runtime_error("wl_display_connect failed");
+
+    static const wl_output_listener output_listener {
+        .geometry = [] (void*, ::wl_output*, int32_t, int32_t, int32_t, int32_t, int32_t, const char*, const char*, int32_t) {},
+        .mode = [] (void *data, ::wl_output*, uint32_t flags, int32_t, int32_t, int32_t refresh) {
+            if (flags & WL_OUTPUT_MODE_CURRENT)
+                static_cast<output*>(data)->refresh_rate = refresh / 1000.;
+        },
+        .done  = [] (void*, ::wl_output*) {},
+        .scale = [] (void*, ::wl_output*, int32_t) {},
+        .name  = [] (void *data, ::wl_output*, const char *name) {
+            static_cast<output*>(data)->name = name;
+        },
+        .description = [] (void*, ::wl_output*, const char*) {},
+    };
+
+    static const wl_registry_listener listener {
+        .global = [] (void *data, wl_registry *registry, uint32_t name, const char *interface, uint32_t version) {
+            gamma_control &self = *static_cast<gamma_control*>(data);
+            if (std::strcmp(interface, zwlr_gamma_control_manager_v1_interface.name) == 0) {
+                self.manager_ = static_cast<zwlr_gamma_control_manager_v1*>(wl_registry_bind(registry, name, &zwlr_gamma_control_manager_v1_interface, 1));
+            } else if (std::strcmp(interface, wl_output_interface.name) == 0) {
+                if (self.started_) {
+                    spdlog::info("[gamma-control] output added, restart to set its gamma");
+                    return;
+                }
+                auto o = std::make_unique<output>();
+                o->parent    = &self;
+                o->global    = name;
+                o->wl_output = static_cast<::wl_output*>(wl_registry_bind(registry, name, &wl_output_interface, std::min(version, 4u)));
+                wl_output_add_listener(o->wl_output, &output_listener, o.get());
+                self.outputs_.push_back(std::move(o));
+            }
+        },
+        .global_remove = [] (void *data, wl_registry*, uint32_t name) {
+            gamma_control &self = *static_cast<gamma_control*>(data);
+            const auto it = std::ranges::find_if(self.outputs_, [name] (const auto &o) { return o->global == name && o->wl_output; });
+            if (it == self.outputs_.end())
+                return;
+
+            // The screen index stays, without gamma, so that the other outputs keep theirs.
+            output &o = **it;
+            spdlog::warn("[gamma-control] {}: output removed", o.name);
+            o.release_control();
+            wl_output_destroy(o.wl_output);
+            o.wl_output = nullptr;
+            o.ramp_size = 0;
+            o.failed    = false;
+            o.lost      = false;
+            o.missed.clear();
+        },
+    };
+
+    registry_ = wl_display_get_registry(display_);
+    wl_registry_add_listener(registry_, &listener, this);
+    wl_display_roundtrip(display_);
+
+    if (!manager_) {
+        outputs_.clear();
+        wl_registry_destroy(registry_);
+        wl_display_disconnect(display_);
+        throw std::runtime_error("zwlr_gamma_control_manager_v1 not supported by the compositor");
+    }
+
+    for (const auto &o : outputs_)
+        o->create_control();
+
+    // Output modes and names, then gamma sizes.
+    wl_display_roundtrip(display_);
+
+    for (const auto &o : outputs_) {
+        if (o->failed) {
+            spdlog::warn("[gamma-control] {}: gamma control not available", o->name);
+            o->ramp_size = 0;
+        } else {
+            spdlog::info("[gamma-control] found: {}, gamma size: {}, refresh rate: {:.2f}", o->name, o->ramp_size, o->refresh_rate);
+        }
+    }
+
+    failures_ = 0;
+    started_  = true;
+}
+
+gamma_control::~gamma_control() {
+    // Destroying the controls restores the original tables.
+    outputs_.clear();
+    zwlr_gamma_control_manager_v1_destroy(manager_);
+    wl_registry_destroy(registry_);
+    wl_display_flush(display_);
+    wl_display_disconnect(display_);
+}
+
+size_t gamma_control::ramp_size(size_t idx) const {
+    return outputs_[idx]->ramp_size;
+}
+
+std::vector<gamma_output> gamma_control::outputs() const {
+    std::vector<gamma_output> ret;
+    ret.reserve(outputs_.size());
+    for (const auto &o : outputs_)
+        ret.push_back({o->name, o->ramp_size, o->refresh_rate, connector_edid(o->name)});
+    return ret;
+}
+
+void gamma_control::queue_gamma(size_t idx, std::span<const uint16_t> ramps) {
+    output &o = *outputs_[idx];
+
+    // Removed by the compositor.
+    if (!o.wl_output)
+        return;
+
+    // The compositor dropped the control, for instance to another client. Ask for a new one:
+    // it takes tables once its size comes back, which happens at the next flush.
+    if (o.failed) {
+        o.release_control();
+        o.ramp_size = 0;
+        o.lost      = true;
+        o.create_control();
+        o.missed.assign(ramps.begin(), ramps.end());
+        return;
+    }
+
+    if (o.ramp_size == 0) {
+        o.missed.assign(ramps.begin(), ramps.end());
+        return;
+    }
+
+    // Made for a previous control of another size.
+    if (ramps.size() != size_t(o.ramp_size) * 3) {
+        ++failures_;
+        return;
+    }
+
+    if (!o.write_table(ramps)) {
+        ++failures_;
+        return;
+    }
+
+    // The descriptor is duplicated into the request, the memfd stays ours.
+    zwlr_gamma_control_v1_set_gamma(o.control, o.fd);
+}
+
+size_t gamma_control::flush() {
+    // The compositor reads a table while handling set_gamma, and the next one goes into the same file.
+    // Waiting for the roundtrip ensures it is done reading, and brings back failed events.
+    const auto roundtrip = [this] {
+        if (wl_display_roundtrip(display_) < 0)
+            throw std::runtime_error(fmt::format("wayland display error: {}", std::strerror(wl_display_get_error(display_))));
+    };
+
+    roundtrip();
+
+    // Controls asked for again that got their size: send them the ramps they missed.
+    bool resent = false;
+    for (const auto &o : outputs_) {
+        if (o->missed.empty() || o->failed || o->ramp_size == 0)
+            continue;
+
+        // The size changed: the ramps have to be made again.
+        if (o->missed.size() != size_t(o->ramp_size) * 3 || !o->write_table(o->missed)) {
+            ++failures_;
+        } else {
+            zwlr_gamma_control_v1_set_gamma(o->control, o->fd);
+            resent = true;
+        }
+        o->missed.clear();
+    }
+
+    if (resent)
+        roundtrip();
+
+    return std::exchange(failures_, 0);
+}
+
+size_t gamma_control::lost_outputs() const {
+    return std::ranges::count_if(outputs_, [] (const auto &o) { return o->lost; });
+}
+
+void gamma_control::retry() {
+    for (const auto &o : outputs_) {
+        if (!o->lost || !o->failed)
+            continue;
+        o->release_control();
+        o->create_control();
+    }
+
+    // Brings back the sizes or failures of the new controls, and sends them the ramps they missed.
+    flush();
+}
+
+std::vector<gamma_output> gamma_outputs() {
+    try {
+        const gamma_control control;
+        std::vector<gamma_output> ret = control.outputs();
+        if (std::ranges::none_of(ret, [] (const gamma_output &o) { return o.ramp_size > 0; }))
+            return {};
+        return ret;
+    } catch (const std::runtime_error &e) {
+        spdlog::debug("[gamma-control] {}", e.what());
+        return {};
+    }
+}
+
+} // namespace wl
+} // namespace gummyd
@@ -0,0 +1,100 @@
+// Copyright 2021-2024 Francesco Fusco <f.fusco@pm.me>
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#ifndef WL_GAMMA_CONTROL_HPP
+#define WL_GAMMA_CONTROL_HPP
+
+#include <span>
+#include <array>
+#include <string>
+#include <vector>
+#include <memory>
+#include <cstdint>
+
+struct wl_display;
+struct wl_registry;
+struct wl_output;
+struct zwlr_gamma_control_manager_v1;
+struct zwlr_gamma_control_v1;
+
+namespace gummyd {
+namespace wl {
+
+struct gamma_output {
+    // Such as DP-1. Empty if the compositor does not send output names.
+    std::string name;
+    // 0 if the output does not take gamma tables.
+    size_t ramp_size;
+    // In Hz, 0 if unknown.
+    double refresh_rate;
+    // Read from the DRM connector of the same name, zeroed if not found.
+    std::array<uint8_t, 128> edid;
+};
+
+// Sets gamma through wlr-gamma-control (wlroots compositors, such as sway).
+// Each output keeps a memfd of the table size, which is rewritten in place and passed again on every change.
+class gamma_control {
+    struct output {
+        gamma_control *parent;
+        // Registry name of the wl_output global.
+        uint32_t global;
+        // Null once the compositor removed the output.
+        ::wl_output *wl_output;
+        zwlr_gamma_control_v1 *control = nullptr;
+        std::string name;
+        uint32_t ramp_size  = 0;
+        double refresh_rate = 0.;
+        bool failed = false;
+        // The control was taken away, and the one asked for instead has not got a size yet.
+        bool lost = false;
+        // Last ramps queued while the control was being created again, sent once its size is known.
+        std::vector<uint16_t> missed;
+
+        // Table shared with the compositor, sized for `table_size` ramps.
+        int fd = -1;
+        uint32_t table_size = 0;
+
+        ~output();
+        void create_control();
+        void release_control();
+        bool write_table(std::span<const uint16_t> ramps);
+    };
+
+    wl_display *display_;
+    wl_registry *registry_;
+    zwlr_gamma_control_manager_v1 *manager_;
+    std::vector<std::unique_ptr<output>> outputs_;
+    size_t failures_;
+    // Screen indices are fixed once constructed: outputs announced later are ignored.
+    bool started_;
+
+public:
+    gamma_control();
+    ~gamma_control();
+    gamma_control(gamma_control&&) = delete;
+
+    // Outputs in the order the compositor announced them.
+    std::vector<gamma_output> outputs() const;
+    // Gamma size of the output's control as of the last flush, 0 while a new control waits for it.
+    size_t ramp_size(size_t idx) const;
+
+    // Write the ramps (all red values, then green, then blue) into the output's table and send it.
+    // If the compositor took the control away, a new one is asked for, and gets the ramps once it is ready.
+    void queue_gamma(size_t idx, std::span<const uint16_t> ramps);
+    // Wait for the compositor to apply everything queued.
+    // Returns the number of tables rejected, or controls lost, since the previous call.
+    size_t flush();
+    // Outputs whose control was taken away, and not given back yet.
+    size_t lost_outputs() const;
+    // Ask again for the controls of lost outputs that failed once more, then flush.
+    void retry();
+};
+
+// Outputs of a compositor with wlr-gamma-control.
+// Empty if there is no compositor, if it lacks the protocol, or if no output takes gamma tables.
+std::vector<gamma_output> gamma_outputs();
+
+} // namespace wl
+} // namespace gummyd
+
+#endif // WL_GAMMA_CONTROL_HPP
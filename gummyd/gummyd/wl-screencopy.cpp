@@ -0,0 +1,295 @@
+// Copyright 2021-2024 Francesco Fusco <f.fusco@pm.me>
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include <bit>
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <spdlog/spdlog.h>
+#include <wayland-client.h>
+#include <wlr-screencopy-unstable-v1-client-protocol.h>
+#include <gummyd/wl-screencopy.hpp>
+
+namespace gummyd {
+namespace wl {
+
+std::optional<luminance::pixel_format> pixel_format(uint32_t wl_shm_format) {
+    using enum luminance::pixel_format;
+
+    // wl_shm formats are little-endian. Byte formats map directly,
+    // packed ones only match the kernels' native words on little-endian hosts.
+    constexpr bool little_endian = std::endian::native == std::endian::little;
+
+    switch (wl_shm_format) {
+    case WL_SHM_FORMAT_ARGB8888:
+    case WL_SHM_FORMAT_XRGB8888:
+        return BGRX32;
+    case WL_SHM_FORMAT_ABGR8888:
+    case WL_SHM_FORMAT_XBGR8888:
+        return RGBX32;
+    case WL_SHM_FORMAT_RGB888:
+        return BGR24;
+    case WL_SHM_FORMAT_BGR888:
+        return RGB24;
+    case WL_SHM_FORMAT_ARGB2101010:
+    case WL_SHM_FORMAT_XRGB2101010:
+        if (little_endian)
+            return X2R10G10B10;
+        break;
+    case WL_SHM_FORMAT_ABGR2101010:
+    case WL_SHM_FORMAT_XBGR2101010:
+        if (little_endian)
+            return X2B10G10R10;
+        break;
+    case WL_SHM_FORMAT_RGB565:
+        if (little_endian)
+            return R5G6B5;
+        break;
+    }
+
+    return std::nullopt;
+}
+
+screencopy::output::~output() {
+    release_frame();
+    release_buffer();
+    wl_output_destroy(wl_output);
+}
+
+void screencopy::output::release_frame() {
+    if (frame) {
+        zwlr_screencopy_frame_v1_destroy(frame);
+        frame = nullptr;
+    }
+    state = state::IDLE;
+}
+
+void screencopy::output::release_buffer() {
+    if (buffer) {
+        wl_buffer_destroy(buffer);
+        buffer = nullptr;
+    }
+    if (data) {
+        munmap(data, size);
+        data = nullptr;
+    }
+    size = 0;
+}
+
+void screencopy::output::capture() {
+    static const zwlr_screencopy_frame_v1_listener listener {
+        .buffer = [] (void *data, zwlr_screencopy_frame_v1*, uint32_t format, uint32_t width, uint32_t height, uint32_t stride) {
+            output &o = *static_cast<output*>(data);
+            o.wl_format = format;
+            o.width     = width;
+            o.height    = height;
+            o.stride    = stride;
+            // Before version 3, this is the only buffer type and nothing else follows.
+            if (o.parent->manager_version_ < 3)
+                o.copy();
+        },
+        .flags = [] (void*, zwlr_screencopy_frame_v1*, uint32_t) {
+            // Rows may come bottom-up. Histograms do not care about the order.
+        },
+        .ready = [] (void *data, zwlr_screencopy_frame_v1*, uint32_t, uint32_t, uint32_t) {
+            static_cast<output*>(data)->state = state::READY;
+        },
+        .failed = [] (void *data, zwlr_screencopy_frame_v1*) {
+            static_cast<output*>(data)->state = state::FAILED;
+        },
+        .damage = [] (void *data, zwlr_screencopy_frame_v1*, uint32_t x, uint32_t y, uint32_t width, uint32_t height) {
+            static_cast<output*>(data)->damage.push_back({int(x), int(y), int(width), int(height)});
+        },
+        .linux_dmabuf = [] (void*, zwlr_screencopy_frame_v1*, uint32_t, uint32_t, uint32_t) {
+            // Only wl_shm buffers are used.
+        },
+        .buffer_done = [] (void *data, zwlr_screencopy_frame_v1*) {
+            static_cast<output*>(data)->copy();
+        },
+    };
+
+    frame = zwlr_screencopy_manager_v1_capture_output(parent->manager_, 0, wl_output);
+    zwlr_screencopy_frame_v1_add_listener(frame, &listener, this);
+    state = state::NEGOTIATING;
+}
+
+void screencopy::output::copy() {
+    if (state != state::NEGOTIATING)
+        return;
+
+    if (!wl::pixel_format(wl_format)) {
+        spdlog::error("[screencopy] unsupported wl_shm format: {:#x}", wl_format);
+        state = state::FAILED;
+        return;
+    }
+
+    // The buffer is kept as long as the compositor keeps asking for the same one.
+    if (!buffer
+    || buffer_format != wl_format
+    || buffer_width  != width
+    || buffer_height != height
+    || buffer_stride != stride) {
+        release_buffer();
+
+        const size_t new_size = size_t(stride) * height;
+        const int fd = memfd_create("gummyd-screencopy", MFD_CLOEXEC);
+        if (fd < 0 || ftruncate(fd, new_size) < 0) {
+            spdlog::error("[screencopy] shared memory allocation failed: {}", std::strerror(errno));
+            if (fd >= 0)
+                close(fd);
+            state = state::FAILED;
+            return;
+        }
+
+        void *addr = mmap(nullptr, new_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (addr == MAP_FAILED) {
+            spdlog::error("[screencopy] mmap failed: {}", std::strerror(errno));
+            close(fd);
+            state = state::FAILED;
+            return;
+        }
+
+        wl_shm_pool *pool = wl_shm_create_pool(parent->shm_, fd, new_size);
+        buffer = wl_shm_pool_create_buffer(pool, 0, width, height, stride, wl_format);
+        wl_shm_pool_destroy(pool);
+        close(fd);
+
+        data          = static_cast<uint8_t*>(addr);
+        size          = new_size;
+        buffer_format = wl_format;
+        buffer_width  = width;
+        buffer_height = height;
+        buffer_stride = stride;
+        full          = true;
+
+        spdlog::debug("[screencopy] new buffer: {} * {}, stride: {}, format: {:#x}", width, height, stride, wl_format);
+    }
+
+    damage.clear();
+
+    // A new buffer is filled right away, so that static outputs get measured too.
+    if (parent->manager_version_ >= 2 && !full) {
+        zwlr_screencopy_frame_v1_copy_with_damage(frame, buffer);
+    } else {
+        zwlr_screencopy_frame_v1_copy(frame, buffer);
+        full = true;
+    }
+
+    state = state::COPYING;
+}
+
+screencopy::screencopy()
+    : display_(wl_display_connect(nullptr)),
+      registry_(nullptr),
+      shm_(nullptr),
+      manager_(nullptr),
+      manager_version_(0) {
+    if (!display_)
+        throw std::runtime_error("wl_display_connect failed");
+
+    static const wl_registry_listener listener {
+        .global = [] (void *data, wl_registry *registry, uint32_t name, const char *interface, uint32_t version) {
+            screencopy &self = *static_cast<screencopy*>(data);
+            if (std::strcmp(interface, wl_shm_interface.name) == 0) {
+                self.shm_ = static_cast<wl_shm*>(wl_registry_bind(registry, name, &wl_shm_interface, 1));
+            } else if (std::strcmp(interface, zwlr_screencopy_manager_v1_interface.name) == 0) {
+                self.manager_version_ = std::min(version, 3u);
+                self.manager_ = static_cast<zwlr_screencopy_manager_v1*>(wl_registry_bind(registry, name, &zwlr_screencopy_manager_v1_interface, self.manager_version_));
+            } else if (std::strcmp(interface, wl_output_interface.name) == 0) {
+                auto o = std::make_unique<output>();
+                o->parent    = &self;
+                o->wl_output = static_cast<::wl_output*>(wl_registry_bind(registry, name, &wl_output_interface, 1));
+                self.outputs_.push_back(std::move(o));
+            }
+        },
+        .global_remove = [] (void*, wl_registry*, uint32_t name) {
+            spdlog::warn("[screencopy] global {} removed", name);
+        },
+    };
+
+    registry_ = wl_display_get_registry(display_);
+    wl_registry_add_listener(registry_, &listener, this);
+    wl_display_roundtrip(display_);
+
+    if (!shm_ || !manager_) {
+        outputs_.clear();
+        if (manager_)
+            zwlr_screencopy_manager_v1_destroy(manager_);
+        if (shm_)
+            wl_shm_destroy(shm_);
+        wl_registry_destroy(registry_);
+        wl_display_disconnect(display_);
+        throw std::runtime_error("zwlr_screencopy_manager_v1 not supported by the compositor");
+    }
+
+    spdlog::info("[screencopy] found {} output(s), protocol version: {}", outputs_.size(), manager_version_);
+}
+
+screencopy::~screencopy() {
+    outputs_.clear();
+    zwlr_screencopy_manager_v1_destroy(manager_);
+    wl_shm_destroy(shm_);
+    wl_registry_destroy(registry_);
+    wl_display_flush(display_);
+    wl_display_disconnect(display_);
+}
+
+size_t screencopy::output_count() const {
+    return outputs_.size();
+}
+
+void screencopy::read_events() {
+    while (wl_display_prepare_read(display_) != 0)
+        wl_display_dispatch_pending(display_);
+
+    wl_display_flush(display_);
+
+    pollfd fd {wl_display_get_fd(display_), POLLIN, 0};
+    if (poll(&fd, 1, 0) > 0) {
+        wl_display_read_events(display_);
+    } else {
+        wl_display_cancel_read(display_);
+    }
+
+    wl_display_dispatch_pending(display_);
+
+    if (const int err = wl_display_get_error(display_); err != 0)
+        throw std::runtime_error(fmt::format("wayland display error: {}", std::strerror(err)));
+}
+
+void screencopy::dispatch(std::function<void(size_t idx, const frame&)> fn) {
+    read_events();
+
+    for (size_t idx = 0; idx < outputs_.size(); ++idx) {
+        output &o = *outputs_[idx];
+
+        if (o.state == output::state::READY) {
+            fn(idx, {
+                std::span<const uint8_t>(o.data, o.size),
+                o.buffer_stride,
+                int(o.buffer_width),
+                int(o.buffer_height),
+                *wl::pixel_format(o.buffer_format),
+                o.damage,
+                o.full,
+            });
+            o.full = false;
+            o.release_frame();
+        } else if (o.state == output::state::FAILED) {
+            spdlog::debug("[screencopy] output {}: capture failed", idx);
+            o.full = true;
+            o.release_frame();
+        }
+
+        if (o.state == output::state::IDLE)
+            o.capture();
+    }
+
+    wl_display_flush(display_);
+}
+
+} // namespace wl
+} // namespace gummyd
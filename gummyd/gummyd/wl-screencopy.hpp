@@ -0,0 +1,111 @@
+// Copyright 2021-2024 Francesco Fusco <f.fusco@pm.me>
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#ifndef WL_SCREENCOPY_HPP
+#define WL_SCREENCOPY_HPP
+
+#include <span>
+#include <vector>
+#include <memory>
+#include <optional>
+#include <functional>
+#include <cstdint>
+
+#include <gummyd/luminance.hpp>
+
+struct wl_display;
+struct wl_registry;
+struct wl_shm;
+struct wl_output;
+struct wl_buffer;
+struct zwlr_screencopy_manager_v1;
+struct zwlr_screencopy_frame_v1;
+
+namespace gummyd {
+namespace wl {
+
+// Pixel format of a wl_shm format code, if the luminance kernels support it.
+std::optional<luminance::pixel_format> pixel_format(uint32_t wl_shm_format);
+
+// Captures outputs through wlr-screencopy (wlroots compositors, such as sway).
+// Frames are copied into a wl_shm buffer kept for each output and requested with copy_with_damage,
+// so that the compositor only answers once something on the output has changed.
+class screencopy {
+public:
+    // A completed capture. `damage` is in buffer coordinates.
+    // When `full` is set, the buffer is new or damage is unknown, and every pixel should be read.
+    struct frame {
+        std::span<const uint8_t> data;
+        size_t stride;
+        int width;
+        int height;
+        luminance::pixel_format format;
+        const std::vector<luminance::rect> &damage;
+        bool full;
+    };
+
+private:
+    struct output {
+        screencopy *parent;
+        ::wl_output *wl_output;
+        zwlr_screencopy_frame_v1 *frame = nullptr;
+
+        enum class state {
+            IDLE,
+            NEGOTIATING,
+            COPYING,
+            READY,
+            FAILED,
+        } state = state::IDLE;
+
+        // Buffer requested by the compositor for the pending frame.
+        uint32_t wl_format = 0;
+        uint32_t width     = 0;
+        uint32_t height    = 0;
+        uint32_t stride    = 0;
+
+        // Buffer kept between frames.
+        ::wl_buffer *buffer = nullptr;
+        uint8_t *data       = nullptr;
+        size_t size         = 0;
+        uint32_t buffer_format = 0;
+        uint32_t buffer_width  = 0;
+        uint32_t buffer_height = 0;
+        uint32_t buffer_stride = 0;
+
+        std::vector<luminance::rect> damage;
+        bool full = true;
+
+        ~output();
+        void capture();
+        void copy();
+        void release_frame();
+        void release_buffer();
+    };
+
+    wl_display *display_;
+    wl_registry *registry_;
+    wl_shm *shm_;
+    zwlr_screencopy_manager_v1 *manager_;
+    uint32_t manager_version_;
+    std::vector<std::unique_ptr<output>> outputs_;
+
+    void read_events();
+
+public:
+    screencopy();
+    ~screencopy();
+    screencopy(screencopy&&) = delete;
+
+    // Outputs in the order the compositor announced them.
+    size_t output_count() const;
+
+    // Read pending events without blocking, then ask for a new frame on every output without one in flight.
+    // `fn` is called for each output whose frame completed since the previous call.
+    void dispatch(std::function<void(size_t idx, const frame&)> fn);
+};
+
+} // namespace wl
+} // namespace gummyd
+
+#endif // WL_SCREENCOPY_HPP
@@ -0,0 +1,75 @@
+// Copyright 2021-2024 Francesco Fusco <f.fusco@pm.me>
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include <gummyd/worker-pool.hpp>
+
+using namespace gummyd;
+
+worker_pool::worker_pool(size_t threads)
+    : job_count_(0),
+      next_(0),
+      busy_(0),
+      generation_(0) {
+    threads_.reserve(threads);
+    for (size_t i = 0; i < threads; ++i) {
+        threads_.emplace_back([this] (std::stop_token stoken) {
+            uint64_t seen = 0;
+            while (true) {
+                {
+                    std::unique_lock lock(mtx_);
+                    if (!start_cv_.wait(lock, stoken, [&] { return generation_ != seen; }))
+                        return;
+                    seen = generation_;
+                }
+
+                work();
+
+                std::lock_guard lock(mtx_);
+                if (--busy_ == 0)
+                    done_cv_.notify_one();
+            }
+        });
+    }
+}
+
+worker_pool::~worker_pool() {
+    // Stop and join before the members they use go away.
+    threads_.clear();
+}
+
+size_t worker_pool::size() const {
+    return threads_.size() + 1;
+}
+
+void worker_pool::work() {
+    for (size_t i = next_.fetch_add(1); i < job_count_; i = next_.fetch_add(1)) {
+        job_(i);
+    }
+}
+
+void worker_pool::run(size_t count, std::function<void(size_t)> fn) {
+    if (count == 0)
+        return;
+
+    if (count == 1 || threads_.empty()) {
+        for (size_t i = 0; i < count; ++i)
+            fn(i);
+        return;
+    }
+
+    {
+        std::lock_guard lock(mtx_);
+        job_       = std::move(fn);
+        job_count_ = count;
+        next_      = 0;
+        busy_      = threads_.size();
+        ++generation_;
+    }
+    start_cv_.notify_all();
+
+    work();
+
+    std::unique_lock lock(mtx_);
+    done_cv_.wait(lock, [&] { return busy_ == 0; });
+    job_ = nullptr;
+}
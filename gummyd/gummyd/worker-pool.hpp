@@ -0,0 +1,44 @@
+// Copyright 2021-2024 Francesco Fusco <f.fusco@pm.me>
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#ifndef WORKER_POOL_HPP
+#define WORKER_POOL_HPP
+
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <vector>
+#include <cstdint>
+#include <functional>
+#include <condition_variable>
+
+namespace gummyd {
+
+// Fixed set of threads that split a batch of independent jobs.
+class worker_pool {
+    std::mutex mtx_;
+    std::condition_variable_any start_cv_;
+    std::condition_variable done_cv_;
+    std::function<void(size_t)> job_;
+    size_t job_count_;
+    std::atomic<size_t> next_;
+    size_t busy_;
+    uint64_t generation_;
+    void work();
+    std::vector<std::jthread> threads_;
+public:
+    // `threads` extra threads, the caller of run() takes part as well.
+    worker_pool(size_t threads);
+    ~worker_pool();
+
+    // Threads working on each batch, including the caller.
+    size_t size() const;
+
+    // Call `fn(i)` for every i in [0, count) and return when all calls are done.
+    // `fn` must be safe to call concurrently for different values of i.
+    void run(size_t count, std::function<void(size_t)> fn);
+};
+
+}
+
+#endif // WORKER_POOL_HPP
@@ -2,13 +2,20 @@
 // SPDX-License-Identifier: GPL-3.0-or-later
 
 #include <span>
+#include <string_view>
 #include <algorithm>
 #include <xcb/xcb.h>
+#include <xcb/xcbext.h>
 #include <xcb/randr.h>
 #include <xcb/shm.h>
-#include <xcb/xcb_image.h>
+#include <xcb/damage.h>
+#include <xcb/render.h>
+#include <xcb/xcb_renderutil.h>
 #include <sys/ipc.h>
 #include <sys/shm.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <cstring>
 #include <spdlog/spdlog.h>
 #include <gummyd/x11-xcb.hpp>
 #include <gummyd/utils.hpp>
@@ -21,8 +28,13 @@ void throw_if(xcb_generic_error_t *err, std::string err_str) {
         throw std::runtime_error(err_str + " " + std::to_string(err->error_code));
 }
 
-size_t screen_size(xcb_screen_t *scr) {
-    return scr->width_in_pixels * scr->height_in_pixels * scr->root_depth;
+size_t bits_per_pixel(const connection &conn, uint8_t depth) {
+    const xcb_setup_t *setup = xcb_get_setup(conn.get());
+    for (auto it = xcb_setup_pixmap_formats_iterator(setup); it.rem > 0; xcb_format_next(&it)) {
+        if (it.data->depth == depth)
+            return it.data->bits_per_pixel;
+    }
+    throw std::runtime_error(fmt::format("XCB: no pixmap format for depth {}", depth));
 }
 
 connection::connection() : addr_(xcb_connect(nullptr, nullptr)) {
@@ -60,31 +72,86 @@ bool connection::extension_present(std::string name) const {
     return query_r && query_r->present;
 }
 
-shared_memory::shared_memory(size_t size) {
-    shminfo_.shmseg  = xcb_generate_id(conn_.get());
-    shminfo_.shmid   = shmget(IPC_PRIVATE, size, IPC_CREAT | 0600);
-    shminfo_.shmaddr = reinterpret_cast<uint8_t*>(shmat(shminfo_.shmid, nullptr, 0));
-
-    auto req = xcb_shm_attach_checked(conn_.get(), shminfo_.shmseg, shminfo_.shmid, 0);
-    throw_if(xcb_request_check(conn_.get(), req), "xcb_shm_attach_checked");
+shared_memory::shared_memory(const connection &conn, size_t size)
+    : conn_(conn),
+      seg_(xcb_generate_id(conn.get())),
+      size_(size) {
+    xcb_generic_error_t *err;
+    auto ver_c = xcb_shm_query_version(conn_.get());
+    auto ver_r = c_unique_ptr<xcb_shm_query_version_reply_t>(xcb_shm_query_version_reply(conn_.get(), ver_c, &err));
+    throw_if(err, "xcb_shm_query_version");
+
+    // MIT-SHM 1.2 takes a file descriptor, which leaves nothing behind in the SysV namespace.
+    memfd_ = ver_r->major_version > 1 || (ver_r->major_version == 1 && ver_r->minor_version >= 2);
+
+    if (memfd_) {
+        const int fd = memfd_create("gummyd-shm", MFD_CLOEXEC);
+        if (fd < 0)
+            throw std::runtime_error(fmt::format("memfd_create failed: {}", std::strerror(errno)));
+
+        if (ftruncate(fd, size_) < 0) {
+            close(fd);
+            throw std::runtime_error(fmt::format("ftruncate failed: {}", std::strerror(errno)));
+        }
+
+        void *addr = mmap(nullptr, size_, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (addr == MAP_FAILED) {
+            close(fd);
+            throw std::runtime_error(fmt::format("mmap failed: {}", std::strerror(errno)));
+        }
+        addr_ = static_cast<uint8_t*>(addr);
+
+        // libxcb closes the descriptor once it has been sent.
+        auto req = xcb_shm_attach_fd_checked(conn_.get(), seg_, fd, 0);
+        if (xcb_generic_error_t *e = xcb_request_check(conn_.get(), req)) {
+            munmap(addr_, size_);
+            throw_if(e, "xcb_shm_attach_fd_checked");
+        }
+    } else {
+        const int id = shmget(IPC_PRIVATE, size_, IPC_CREAT | 0600);
+        if (id < 0)
+            throw std::runtime_error(fmt::format("shmget failed: {}", std::strerror(errno)));
+
+        void *addr = shmat(id, nullptr, 0);
+        if (addr == reinterpret_cast<void*>(-1)) {
+            const int err = errno;
+            shmctl(id, IPC_RMID, nullptr);
+            throw std::runtime_error(fmt::format("shmat failed: {}", std::strerror(err)));
+        }
+        addr_ = static_cast<uint8_t*>(addr);
+
+        auto req = xcb_shm_attach_checked(conn_.get(), seg_, id, 0);
+        xcb_generic_error_t *e = xcb_request_check(conn_.get(), req);
+
+        // Marked for removal right away: the segment goes with the last detach, even if we crash.
+        shmctl(id, IPC_RMID, nullptr);
+
+        if (e) {
+            shmdt(addr_);
+            throw_if(e, "xcb_shm_attach_checked");
+        }
+    }
 }
 
 shared_memory::~shared_memory() {
-    xcb_request_check(conn_.get(), xcb_shm_detach_checked(conn_.get(), shminfo_.shmseg));
-    shmdt(shminfo_.shmaddr);
-    shmctl(shminfo_.shmseg, IPC_RMID, 0);
+    xcb_request_check(conn_.get(), xcb_shm_detach_checked(conn_.get(), seg_));
+    if (memfd_) {
+        munmap(addr_, size_);
+    } else {
+        shmdt(addr_);
+    }
 }
 
 unsigned int shared_memory::seg() const {
-    return shminfo_.shmseg;
+    return seg_;
 }
 
-unsigned int shared_memory::id() const {
-    return shminfo_.shmid;
+uint8_t* shared_memory::addr() const {
+    return addr_;
 }
 
-uint8_t* shared_memory::addr() const {
-    return shminfo_.shmaddr;
+size_t shared_memory::size() const {
+    return size_;
 }
 
 std::vector<randr::output> randr::outputs(const connection &conn, xcb_screen_t *screen) {
@@ -144,6 +211,22 @@ std::vector<randr::output> randr::outputs(const connection &conn, xcb_screen_t *
         auto gamma_r = c_unique_ptr<xcb_randr_get_crtc_gamma_size_reply_t>(xcb_randr_get_crtc_gamma_size_reply(conn.get(), gamma_c, &err));
         throw_if(err, "xcb_randr_get_crtc_gamma_size");
 
+        const double refresh_rate = [&] {
+            const std::span modes(xcb_randr_get_screen_resources_current_modes(res_r.get()),
+                                  xcb_randr_get_screen_resources_current_modes_length(res_r.get()));
+            const auto mode = std::find_if(modes.begin(), modes.end(), [&] (const xcb_randr_mode_info_t &m) {
+                return m.id == crtc_info_r->mode;
+            });
+            if (mode == modes.end() || mode->htotal == 0 || mode->vtotal == 0)
+                return 0.;
+            double rate = double(mode->dot_clock) / (double(mode->htotal) * double(mode->vtotal));
+            if (mode->mode_flags & XCB_RANDR_MODE_FLAG_DOUBLE_SCAN)
+                rate /= 2;
+            if (mode->mode_flags & XCB_RANDR_MODE_FLAG_INTERLACE)
+                rate *= 2;
+            return rate;
+        }();
+
         ret.push_back({
                           dsp_id,
                           edid,
@@ -153,6 +236,7 @@ std::vector<randr::output> randr::outputs(const connection &conn, xcb_screen_t *
                           crtc_info_r->x,
                           crtc_info_r->y,
                           gamma_r->size,
+                          refresh_rate,
                       });
     }
 
@@ -168,49 +252,324 @@ void randr::set_gamma(const connection &conn, xcb_randr_crtc_t crtc, const std::
     throw_if(xcb_request_check(conn.get(), req), "xcb_randr_set_crtc_gamma_checked");
 }
 
+void randr::queue_gamma(const connection &conn, xcb_randr_crtc_t crtc, std::span<const uint16_t> ramps) {
+    const size_t sz = ramps.size() / 3;
+    xcb_randr_set_crtc_gamma(conn.get(), crtc, sz,
+                             &ramps[0 * sz],
+                             &ramps[1 * sz],
+                             &ramps[2 * sz]);
+}
+
+size_t randr::flush_gamma(const connection &conn) {
+    xcb_flush(conn.get());
+
+    // Errors of unchecked requests are delivered as events.
+    size_t errors = 0;
+    while (auto ev = c_unique_ptr<xcb_generic_event_t>(xcb_poll_for_event(conn.get()))) {
+        if (ev->response_type != 0)
+            continue;
+        const auto err = reinterpret_cast<const xcb_generic_error_t*>(ev.get());
+        spdlog::error("[xcb] xcb_randr_set_crtc_gamma: error {}, crtc: {}", err->error_code, err->resource_id);
+        ++errors;
+    }
+
+    if (const int err = xcb_connection_has_error(conn.get()); err > 0)
+        throw std::runtime_error("X connection error " + std::to_string(err));
+
+    return errors;
+}
+
+damage::damage() {
+    if (!conn_.extension_present("DAMAGE"))
+        throw std::runtime_error("DAMAGE extension not present");
+
+    // The version must be negotiated before any other damage request.
+    xcb_generic_error_t *err;
+    auto ver_c = xcb_damage_query_version(conn_.get(), XCB_DAMAGE_MAJOR_VERSION, XCB_DAMAGE_MINOR_VERSION);
+    auto ver_r = c_unique_ptr<xcb_damage_query_version_reply_t>(xcb_damage_query_version_reply(conn_.get(), ver_c, &err));
+    throw_if(err, "xcb_damage_query_version");
+
+    first_event_ = xcb_get_extension_data(conn_.get(), &xcb_damage_id)->first_event;
+    damage_      = xcb_generate_id(conn_.get());
+
+    // Delta rectangles: one event each time the damaged region grows.
+    // The region is emptied again in collect().
+    auto req = xcb_damage_create_checked(conn_.get(), damage_, conn_.first_screen()->root, XCB_DAMAGE_REPORT_LEVEL_DELTA_RECTANGLES);
+    throw_if(xcb_request_check(conn_.get(), req), "xcb_damage_create_checked");
+}
+
+damage::~damage() {
+    xcb_damage_destroy(conn_.get(), damage_);
+    xcb_flush(conn_.get());
+}
+
+std::vector<xcb_rectangle_t> damage::collect() {
+    std::vector<xcb_rectangle_t> ret;
+
+    while (auto ev = c_unique_ptr<xcb_generic_event_t>(xcb_poll_for_event(conn_.get()))) {
+        if ((ev->response_type & ~0x80) == first_event_ + XCB_DAMAGE_NOTIFY) {
+            const auto *notify = reinterpret_cast<xcb_damage_notify_event_t*>(ev.get());
+            ret.push_back(notify->area);
+        }
+    }
+
+    xcb_damage_subtract(conn_.get(), damage_, XCB_NONE, XCB_NONE);
+    xcb_flush(conn_.get());
+
+    return ret;
+}
+
 shared_image::shared_image()
-    : shmem_(xcb::screen_size(conn_.first_screen())),
-      image_(xcb_image_create_native(
-                conn_.get(),
-                conn_.first_screen()->width_in_pixels,
-                conn_.first_screen()->height_in_pixels,
-                XCB_IMAGE_FORMAT_Z_PIXMAP,
-                conn_.first_screen()->root_depth,
-                shmem_.addr(),
-                xcb::screen_size(conn_.first_screen()),
-                nullptr))
-{
+    : bits_per_pixel_(xcb::bits_per_pixel(conn_, conn_.first_screen()->root_depth)),
+      next_(0) {
 }
 
 shared_image::~shared_image() {
-    // fails with "free(): invalid pointer".
-    // this is not needed, shared memory takes care of it.
-    //xcb_image_destroy(image);
+    // Replies still on their way would write into segments that are about to go.
+    discard();
 }
 
-int shared_image::get(int16_t x, int16_t y, uint16_t w, uint16_t h, std::function<int(std::span<uint8_t>)> fn) {
-    std::lock_guard lk(mutex_);
+void shared_image::request(int16_t x, int16_t y, uint16_t w, uint16_t h) {
+    if (pending_.size() == shmem_.size())
+        throw std::runtime_error("XSHM: every segment is in use");
+
+    // Rows are padded to 32 bits at most.
+    const size_t pitch = (size_t(w) * bits_per_pixel_ + 31) / 32 * 4;
+    const size_t size  = pitch * h;
+
+    // The other segment may still be waiting to be read. This one is free.
+    std::optional<shared_memory> &shmem = shmem_[next_];
+
+    // Allocated on first use, and grown when a larger area is requested.
+    if (!shmem.has_value() || shmem->size() < size) {
+        shmem.reset();
+        shmem.emplace(conn_, size);
+        spdlog::debug("[XSHM] segment {} size: {} bytes", next_, size);
+    }
+
     auto image_c = xcb_shm_get_image(
                 conn_.get(),
                 conn_.first_screen()->root,
                 x, y,
                 w, h,
                 ~0, XCB_IMAGE_FORMAT_Z_PIXMAP,
-                shmem_.seg(), 0);
+                shmem->seg(), 0);
+
+    xcb_flush(conn_.get());
+
+    SPDLOG_TRACE("[XSHM] requested image: {} * {} | x: {} y: {} (segment: {})", w, h, x, y, next_);
+
+    pending_.push_back({image_c, next_});
+    next_ = (next_ + 1) % shmem_.size();
+}
+
+int shared_image::collect(std::function<int(std::span<uint8_t>)> fn) {
+    if (pending_.empty())
+        return -1;
+
+    const pending p = pending_.front();
+    pending_.pop_front();
+
+    xcb_generic_error_t *err;
+    auto image_r = c_unique_ptr<xcb_shm_get_image_reply_t>(xcb_shm_get_image_reply(conn_.get(), p.cookie, &err));
+    if (!image_r) {
+        const auto e = c_unique_ptr<xcb_generic_error_t>(err);
+        return e ? e->error_code : -1;
+    }
 
+    SPDLOG_TRACE("[XSHM] got image: size: {} (segment: {})", image_r->size, p.seg);
+
+    return fn(std::span(shmem_[p.seg]->addr(), image_r->size));
+}
+
+std::optional<int> shared_image::poll(std::function<int(std::span<uint8_t>)> fn) {
+    if (pending_.empty())
+        return -1;
+
+    const pending p = pending_.front();
+
+    void *reply;
     xcb_generic_error_t *err;
-    auto image_r = xcb_shm_get_image_reply(conn_.get(), image_c, &err);
+    if (xcb_poll_for_reply(conn_.get(), p.cookie.sequence, &reply, &err) == 0)
+        return std::nullopt;
+
+    pending_.pop_front();
+
+    auto image_r = c_unique_ptr<xcb_shm_get_image_reply_t>(static_cast<xcb_shm_get_image_reply_t*>(reply));
     if (!image_r) {
-        return err ? err->error_code : -1;
+        const auto e = c_unique_ptr<xcb_generic_error_t>(err);
+        return e ? e->error_code : -1;
     }
 
-    SPDLOG_TRACE("[XSHM] got image: {} * {} | x: {} y: {} size: {}", w, h, x, y, image_r->size);
+    SPDLOG_TRACE("[XSHM] got image: size: {} (segment: {})", image_r->size, p.seg);
 
-    return fn(std::span(image_->data, image_r->size));
+    return fn(std::span(shmem_[p.seg]->addr(), image_r->size));
 }
 
-size_t shared_image::size() const {
-    return image_->size;
+void shared_image::discard() {
+    while (!pending_.empty())
+        collect([] (std::span<uint8_t>) { return 0; });
+}
+
+int shared_image::get(int16_t x, int16_t y, uint16_t w, uint16_t h, std::function<int(std::span<uint8_t>)> fn) {
+    request(x, y, w, h);
+    return collect(fn);
+}
+
+image_format shared_image::format() const {
+    xcb_screen_t *scr = conn_.first_screen();
+
+    for (auto d = xcb_screen_allowed_depths_iterator(scr); d.rem > 0; xcb_depth_next(&d)) {
+        for (auto v = xcb_depth_visuals_iterator(d.data); v.rem > 0; xcb_visualtype_next(&v)) {
+            if (v.data->visual_id != scr->root_visual)
+                continue;
+            return {
+                uint8_t(bits_per_pixel_),
+                xcb_get_setup(conn_.get())->image_byte_order == XCB_IMAGE_ORDER_MSB_FIRST,
+                v.data->red_mask,
+                v.data->green_mask,
+                v.data->blue_mask,
+            };
+        }
+    }
+
+    throw std::runtime_error("XCB: root visual not found");
+}
+
+patches::patches(std::vector<xcb_rectangle_t> rects)
+    : rects_(std::move(rects)) {
+}
+
+int patches::get(std::function<void(size_t, std::span<const uint8_t>, size_t)> fn) {
+    std::vector<xcb_get_image_cookie_t> cookies;
+    cookies.reserve(rects_.size());
+
+    for (const xcb_rectangle_t &r : rects_) {
+        cookies.push_back(xcb_get_image(conn_.get(), XCB_IMAGE_FORMAT_Z_PIXMAP, conn_.first_screen()->root,
+                                        r.x, r.y, r.width, r.height, ~0));
+    }
+
+    int ret = 0;
+    for (size_t i = 0; i < cookies.size(); ++i) {
+        xcb_generic_error_t *err;
+        auto image_r = c_unique_ptr<xcb_get_image_reply_t>(xcb_get_image_reply(conn_.get(), cookies[i], &err));
+        if (!image_r) {
+            const auto e = c_unique_ptr<xcb_generic_error_t>(err);
+            if (ret == 0)
+                ret = e ? e->error_code : -1;
+            continue;
+        }
+
+        const std::span<const uint8_t> data(xcb_get_image_data(image_r.get()), xcb_get_image_data_length(image_r.get()));
+        fn(i, data, data.size() / rects_[i].height);
+    }
+
+    SPDLOG_TRACE("[x11] got {} patches", rects_.size());
+
+    return ret;
+}
+
+thumbnail::thumbnail(uint16_t w, uint16_t h)
+    : width_(w),
+      height_(h),
+      shmem_(conn_, size_t(w) * h * 4) {
+    if (!conn_.extension_present("RENDER"))
+        throw std::runtime_error("RENDER extension not present");
+
+    xcb_generic_error_t *err;
+    auto ver_c = xcb_render_query_version(conn_.get(), XCB_RENDER_MAJOR_VERSION, XCB_RENDER_MINOR_VERSION);
+    auto ver_r = c_unique_ptr<xcb_render_query_version_reply_t>(xcb_render_query_version_reply(conn_.get(), ver_c, &err));
+    throw_if(err, "xcb_render_query_version");
+
+    // Owned by the connection's render-util cache.
+    const xcb_render_query_pict_formats_reply_t *formats = xcb_render_util_query_formats(conn_.get());
+    if (!formats)
+        throw std::runtime_error("xcb_render_util_query_formats failed");
+
+    xcb_screen_t *scr = conn_.first_screen();
+    const xcb_render_pictvisual_t *root_format = xcb_render_util_find_visual_format(formats, scr->root_visual);
+    const xcb_render_pictforminfo_t *dst_format = xcb_render_util_find_standard_format(formats, XCB_PICT_STANDARD_RGB_24);
+    if (!root_format || !dst_format)
+        throw std::runtime_error("RENDER: picture formats not found");
+
+    const xcb_render_directformat_t &direct = dst_format->direct;
+    format_ = {
+        uint8_t(xcb::bits_per_pixel(conn_, dst_format->depth)),
+        xcb_get_setup(conn_.get())->image_byte_order == XCB_IMAGE_ORDER_MSB_FIRST,
+        uint32_t(direct.red_mask)   << direct.red_shift,
+        uint32_t(direct.green_mask) << direct.green_shift,
+        uint32_t(direct.blue_mask)  << direct.blue_shift,
+    };
+
+    src_    = xcb_generate_id(conn_.get());
+    dst_    = xcb_generate_id(conn_.get());
+    pixmap_ = xcb_generate_id(conn_.get());
+
+    // Read through child windows instead of the root's own (usually empty) contents.
+    const uint32_t subwindow_mode = XCB_SUBWINDOW_MODE_INCLUDE_INFERIORS;
+    auto src_req = xcb_render_create_picture_checked(conn_.get(), src_, scr->root, root_format->format, XCB_RENDER_CP_SUBWINDOW_MODE, &subwindow_mode);
+    throw_if(xcb_request_check(conn_.get(), src_req), "xcb_render_create_picture_checked (src)");
+
+    auto pix_req = xcb_create_pixmap_checked(conn_.get(), 24, pixmap_, scr->root, width_, height_);
+    throw_if(xcb_request_check(conn_.get(), pix_req), "xcb_create_pixmap_checked");
+
+    auto dst_req = xcb_render_create_picture_checked(conn_.get(), dst_, pixmap_, dst_format->id, 0, nullptr);
+    throw_if(xcb_request_check(conn_.get(), dst_req), "xcb_render_create_picture_checked (dst)");
+
+    static constexpr std::string_view filter = "good";
+    xcb_render_set_picture_filter(conn_.get(), src_, filter.size(), filter.data(), 0, nullptr);
+}
+
+thumbnail::~thumbnail() {
+    xcb_render_free_picture(conn_.get(), dst_);
+    xcb_render_free_picture(conn_.get(), src_);
+    xcb_free_pixmap(conn_.get(), pixmap_);
+    xcb_flush(conn_.get());
+}
+
+uint16_t thumbnail::width() const {
+    return width_;
+}
+
+uint16_t thumbnail::height() const {
+    return height_;
+}
+
+image_format thumbnail::format() const {
+    return format_;
+}
+
+int thumbnail::get(int16_t x, int16_t y, uint16_t w, uint16_t h, std::function<int(std::span<uint8_t>)> fn) {
+    // Maps destination pixels back to the source area: src = M * dst.
+    const auto fixed = [] (double v) { return xcb_render_fixed_t(v * 65536); };
+    const xcb_render_transform_t transform {
+        fixed(double(w) / width_), 0, fixed(x),
+        0, fixed(double(h) / height_), fixed(y),
+        0, 0, fixed(1),
+    };
+
+    xcb_render_set_picture_transform(conn_.get(), src_, transform);
+    xcb_render_composite(conn_.get(), XCB_RENDER_PICT_OP_SRC, src_, XCB_NONE, dst_,
+                         0, 0, 0, 0, 0, 0, width_, height_);
+
+    auto image_c = xcb_shm_get_image(
+                conn_.get(),
+                pixmap_,
+                0, 0,
+                width_, height_,
+                ~0, XCB_IMAGE_FORMAT_Z_PIXMAP,
+                shmem_.seg(), 0);
+
+    xcb_generic_error_t *err;
+    auto image_r = c_unique_ptr<xcb_shm_get_image_reply_t>(xcb_shm_get_image_reply(conn_.get(), image_c, &err));
+    if (!image_r) {
+        const auto e = c_unique_ptr<xcb_generic_error_t>(err);
+        return e ? e->error_code : -1;
+    }
+
+    SPDLOG_TRACE("[RENDER] got thumbnail: {} * {} of {} * {} | x: {} y: {}", width_, height_, w, h, x, y);
+
+    return fn(std::span(shmem_.addr(), image_r->size));
 }
 
 } // namespace xcb
@@ -5,10 +5,14 @@
 #define X11_XCB_HPP
 
 #include <span>
+#include <array>
+#include <deque>
+#include <optional>
 #include <xcb/xcb.h>
 #include <xcb/randr.h>
 #include <xcb/shm.h>
-#include <xcb/xcb_image.h>
+#include <xcb/damage.h>
+#include <xcb/render.h>
 #include <sys/ipc.h>
 #include <sys/shm.h>
 #include <spdlog/spdlog.h>
@@ -17,7 +21,6 @@ namespace gummyd {
 namespace xcb {
 
 void throw_if(xcb_generic_error_t *err, std::string err_str);
-size_t screen_size(xcb_screen_t *scr);
 
 class connection {
     xcb_connection_t *addr_;
@@ -31,17 +34,25 @@ public:
     bool extension_present(std::string name) const;
 };
 
+// Memory shared with the X server, through memfd when MIT-SHM supports it.
 class shared_memory {
-    xcb::connection conn_;
-    xcb_shm_segment_info_t shminfo_;
+    const connection &conn_;
+    xcb_shm_seg_t seg_;
+    uint8_t *addr_;
+    size_t size_;
+    bool memfd_;
 public:
-    shared_memory(size_t size);
+    shared_memory(const connection &conn, size_t size);
     ~shared_memory();
+    shared_memory(shared_memory&&) = delete;
     unsigned int seg() const;
-    unsigned int id() const;
     uint8_t* addr() const;
+    size_t size() const;
 };
 
+// Bits per pixel of images with the given depth.
+size_t bits_per_pixel(const connection &conn, uint8_t depth);
+
 namespace randr {
     struct output {
         std::string id;
@@ -52,23 +63,107 @@ namespace randr {
         int16_t x;
         int16_t y;
         uint16_t ramp_size;
+        // In Hz, 0 if unknown.
+        double refresh_rate;
     };
 
     std::vector<output> outputs(const connection &conn, xcb_screen_t *screen);
     void set_gamma(const connection &conn, xcb_randr_crtc_t crtc, const std::vector<uint16_t> &ramps);
+    // Unchecked version of set_gamma. libxcb may write the request as soon as its buffer fills,
+    // but errors are only collected by flush_gamma().
+    void queue_gamma(const connection &conn, xcb_randr_crtc_t crtc, std::span<const uint16_t> ramps);
+    // Send the queued requests, then log the errors received for earlier ones without waiting.
+    // Returns the number of errors. The connection should be used for gamma requests only.
+    size_t flush_gamma(const connection &conn);
 } // namespace randr
 
+// Tracks what changed on the root window through the DAMAGE extension.
+class damage {
+    connection conn_;
+    xcb_damage_damage_t damage_;
+    uint8_t first_event_;
+public:
+    damage();
+    ~damage();
+    damage(damage&&) = delete;
+    // Rectangles (in root coordinates) damaged since the previous call.
+    std::vector<xcb_rectangle_t> collect();
+};
+
+// Layout of the pixels in images of the root window.
+struct image_format {
+    uint8_t bits_per_pixel;
+    bool msb_first;
+    uint32_t red_mask;
+    uint32_t green_mask;
+    uint32_t blue_mask;
+};
+
+// Captures areas of the root window into shared memory.
+// Two segments are used in turn, so that the server can fill one while the other is read.
 class shared_image {
     connection conn_;
-    shared_memory shmem_;
-    xcb_image_t *image_;
-    std::mutex mutex_;
+    size_t bits_per_pixel_;
+    // Each one is sized after the largest area requested into it so far.
+    std::array<std::optional<shared_memory>, 2> shmem_;
+    struct pending {
+        xcb_shm_get_image_cookie_t cookie;
+        size_t seg;
+    };
+    std::deque<pending> pending_;
+    size_t next_;
 public:
     shared_image();
     shared_image(shared_image&&) = delete;
     ~shared_image();
+    // Ask for an area without waiting for it. At most two requests can be pending.
+    void request(int16_t x, int16_t y, uint16_t w, uint16_t h);
+    // Wait for the oldest pending request and pass its pixels to fn.
+    int collect(std::function<int(std::span<uint8_t>)> fn);
+    // Like collect(), but returns nothing instead of waiting if the oldest reply has not arrived yet.
+    std::optional<int> poll(std::function<int(std::span<uint8_t>)> fn);
+    // Wait for every pending request and drop their pixels.
+    void discard();
+    // request() followed by collect().
+    int get(int16_t x, int16_t y, uint16_t w, uint16_t h, std::function<int(std::span<uint8_t>)> fn);
+    image_format format() const;
+};
+
+// Grabs a fixed set of small areas of the root window.
+// They are too small to be worth shared memory, so plain GetImage requests are used,
+// all sent back to back before the first reply is read.
+class patches {
+    connection conn_;
+    std::vector<xcb_rectangle_t> rects_;
+public:
+    patches(std::vector<xcb_rectangle_t> rects);
+    patches(patches&&) = delete;
+    // fn receives the index of each patch, its pixels and their row pitch, in order.
+    // Returns the error code of the first patch that failed, or 0.
+    int get(std::function<void(size_t, std::span<const uint8_t>, size_t)> fn);
+};
+
+// Scales an area of the root window down on the server side with RENDER,
+// so that only a small thumbnail travels over shared memory.
+class thumbnail {
+    connection conn_;
+    uint16_t width_;
+    uint16_t height_;
+    shared_memory shmem_;
+    xcb_pixmap_t pixmap_;
+    xcb_render_picture_t src_;
+    xcb_render_picture_t dst_;
+    image_format format_;
+public:
+    thumbnail(uint16_t w, uint16_t h);
+    thumbnail(thumbnail&&) = delete;
+    ~thumbnail();
+    uint16_t width() const;
+    uint16_t height() const;
+    // Layout of the thumbnail's pixels, an RGB picture that follows the server's byte order.
+    image_format format() const;
+    // fn receives the 32bpp pixels of the area scaled to the thumbnail size.
     int get(int16_t x, int16_t y, uint16_t w, uint16_t h, std::function<int(std::span<uint8_t>)> fn);
-	size_t size() const;
 };
 
 } // namespace xcb
@@ -0,0 +1,60 @@
+// Copyright 2021-2024 Francesco Fusco <f.fusco@pm.me>
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+// Scaling of full-screen tile histogram updates, from one core to all of them.
+// Usage: bench-luminance [width height [iterations]]
+
+#include <chrono>
+#include <algorithm>
+#include <random>
+#include <thread>
+#include <vector>
+#include <cstdlib>
+#include <fmt/core.h>
+
+#include <gummyd/luminance.hpp>
+#include <gummyd/worker-pool.hpp>
+
+using namespace gummyd;
+
+int main(int argc, char **argv) {
+    const int width      = argc > 2 ? std::atoi(argv[1]) : 3840;
+    const int height     = argc > 2 ? std::atoi(argv[2]) : 2160;
+    const int iterations = argc > 3 ? std::atoi(argv[3]) : 50;
+    // Same as screenlight.
+    constexpr int tile_size = 256;
+
+    const size_t pitch = size_t(width) * 4;
+    std::vector<uint8_t> buf (pitch * height);
+    std::mt19937 rng (1);
+    for (uint8_t &b : buf)
+        b = uint8_t(rng());
+
+    const luminance::rect area {0, 0, width, height};
+    const unsigned max_threads = std::max(std::thread::hardware_concurrency(), 1u);
+
+    fmt::print("{} * {}, {} iterations\n", width, height, iterations);
+
+    double base = 0.;
+    for (unsigned threads = 1; threads <= max_threads; ++threads) {
+        worker_pool pool (threads - 1);
+        luminance::tile_grid grid (area, tile_size);
+
+        const auto begin = std::chrono::steady_clock::now();
+        for (int i = 0; i < iterations; ++i) {
+            grid.mark_all();
+            grid.update(buf, area, pitch, pool);
+        }
+        const std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - begin;
+
+        const double per_frame = elapsed.count() / iterations;
+        if (threads == 1)
+            base = per_frame;
+
+        fmt::print("threads: {:2}, {:8.3f} ms/frame, {:7.1f} Mpx/s, speedup: {:.2f}\n",
+                   pool.size(),
+                   per_frame,
+                   double(width) * height / per_frame / 1e3,
+                   base / per_frame);
+    }
+}
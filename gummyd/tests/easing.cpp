@@ -0,0 +1,116 @@
+// Copyright 2021-2024 Francesco Fusco <f.fusco@pm.me>
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+// Runs easing::animate with a wait callback that counts its calls: every integer between start and end
+// must be emitted in order, the animation must end on `end`, and it must wake up at most once per value change.
+
+#include <thread>
+#include <chrono>
+#include <vector>
+#include <cstdint>
+#include <cstdlib>
+#include <numeric>
+#include <utility>
+#include <algorithm>
+#include <functional>
+#include <string_view>
+#include <fmt/core.h>
+
+#include <gummyd/easing.hpp>
+
+using namespace gummyd;
+
+namespace {
+
+int failures = 0;
+
+void check(bool cond, std::string_view what) {
+    if (!cond) {
+        fmt::print(stderr, "failed: {}\n", what);
+        ++failures;
+    }
+}
+
+struct run {
+    std::vector<int> values;
+    size_t wakeups = 0;
+    int ret = 0;
+};
+
+// Sleeps until the deadline, or reports an interrupt once `interrupt_at` wake-ups have happened.
+run animate(int start, int end, int duration_ms, std::function<double(double)> easing, size_t interrupt_at = SIZE_MAX) {
+    run r;
+    r.ret = easing::animate(start, end, duration_ms, easing,
+        [&] (int val) { r.values.push_back(val); },
+        [&] (std::chrono::steady_clock::time_point deadline) {
+            if (++r.wakeups >= interrupt_at)
+                return true;
+            std::this_thread::sleep_until(deadline);
+            return false;
+        });
+    return r;
+}
+
+// The values after start, one by one, up to end.
+std::vector<int> steps(int start, int end) {
+    std::vector<int> ret(std::abs(end - start));
+    const int dir = end > start ? 1 : -1;
+    std::iota(ret.begin(), ret.end(), 0);
+    for (int &v : ret)
+        v = start + dir * (v + 1);
+    return ret;
+}
+
+}
+
+int main() {
+    // Steps are tens of milliseconds apart, so that a late wake-up can't skip one.
+    for (const auto &[start, end] : {std::pair(0, 10), std::pair(10, 0), std::pair(-5, 5)}) {
+        const run r = animate(start, end, 300, easing::ease);
+        check(r.values == steps(start, end), fmt::format("{} -> {}: every value is emitted in order", start, end));
+        check(r.ret == end, fmt::format("{} -> {}: the animation ends on end", start, end));
+        check(r.wakeups <= r.values.size(), fmt::format("{} -> {}: at most one wake-up per value change", start, end));
+    }
+
+    // ease_out_expo stops short of 1 until t = 1, then jumps to it.
+    check(easing::ease_out_expo(0.) == 0., "ease_out_expo(0) is 0");
+    check(easing::ease_out_expo(0.999) < 1., "ease_out_expo is below 1 before the end");
+    check(easing::ease_out_expo(1.) == 1., "ease_out_expo(1) is 1");
+    {
+        const run r = animate(0, 100, 200, easing::ease_out_expo);
+        check(!r.values.empty() && r.values.back() == 100, "ease_out_expo: the last value is end");
+        check(r.ret == 100, "ease_out_expo: the animation ends on end");
+        check(r.wakeups <= r.values.size(), "ease_out_expo: at most one wake-up per value change");
+        check(std::is_sorted(r.values.begin(), r.values.end()) && std::adjacent_find(r.values.begin(), r.values.end()) == r.values.end(),
+              "ease_out_expo: values increase strictly");
+    }
+
+    // Nothing to wait for: end is emitted right away.
+    {
+        const run r = animate(0, 10, 0, easing::ease);
+        check(r.values == std::vector<int>{10}, "zero duration: end is emitted once");
+        check(r.wakeups == 0, "zero duration: no wake-ups");
+        check(r.ret == 10, "zero duration: returns end");
+    }
+    {
+        const run r = animate(7, 7, 300, easing::ease);
+        check(r.values == std::vector<int>{7}, "start == end: end is emitted once");
+        check(r.wakeups == 0, "start == end: no wake-ups");
+    }
+
+    // An interrupt stops the animation at the value it reached.
+    {
+        const run r = animate(0, 10, 300, easing::ease, 1);
+        check(r.values.empty(), "interrupted at once: nothing is emitted");
+        check(r.wakeups == 1, "interrupted at once: wait is not called again");
+        check(r.ret == 0, "interrupted at once: returns start");
+    }
+    {
+        const run r = animate(0, 10, 300, easing::ease, 4);
+        check(r.wakeups == 4, "interrupted later: wait is not called again");
+        check(!r.values.empty() && r.ret == r.values.back() && r.ret < 10, "interrupted later: returns the last value emitted");
+    }
+
+    fmt::print("{} failures\n", failures);
+    return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
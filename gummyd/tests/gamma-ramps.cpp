@@ -0,0 +1,50 @@
+// Copyright 2021-2024 Francesco Fusco <f.fusco@pm.me>
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+// The AVX2 ramp generator must produce exactly the same ramps as the scalar one,
+// for every brightness step that survives sanitizing. Kelvin values are sampled,
+// and odd ramp sizes exercise the tail of the vector loop.
+
+#include <vector>
+#include <cstring>
+#include <cstdlib>
+#include <fmt/core.h>
+
+#include <gummyd/gamma.hpp>
+#include <gummyd/constants.hpp>
+
+using namespace gummyd;
+
+int main() {
+    if (!isa_supported(isa::AVX2)) {
+        fmt::print("AVX2 not supported, nothing to compare\n");
+        return EXIT_SUCCESS;
+    }
+
+    std::vector<int> temperatures;
+    for (int k = constants::temp_k_min; k < constants::temp_k_max; k += 211)
+        temperatures.push_back(k);
+    temperatures.push_back(constants::temp_k_max);
+
+    int failures = 0;
+    size_t checks = 0;
+
+    for (const size_t sz : {7, 256, 1024, 2048, 4096}) {
+        for (int brt = constants::brt_steps_min; brt <= constants::brt_steps_max; ++brt) {
+            for (const int temp : temperatures) {
+                const std::vector<uint16_t> expected = gamma_state::create_ramps(isa::SCALAR, brt, temp, sz);
+                const std::vector<uint16_t> ramps    = gamma_state::create_ramps(isa::AVX2, brt, temp, sz);
+                ++checks;
+
+                if (ramps.size() != expected.size()
+                || std::memcmp(ramps.data(), expected.data(), expected.size() * sizeof(uint16_t)) != 0) {
+                    fmt::print(stderr, "size {}, brightness {}, temperature {}: AVX2 differs from scalar\n", sz, brt, temp);
+                    ++failures;
+                }
+            }
+        }
+    }
+
+    fmt::print("{} comparisons, {} failures\n", checks, failures);
+    return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,107 @@
+// Copyright 2021-2024 Francesco Fusco <f.fusco@pm.me>
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+// Runs the whole gamma_state path, writer thread included, on a backend that only records the ramps:
+// settings must reach every output once, unchanged ramps must be skipped, and resets must go through.
+
+#include <thread>
+#include <chrono>
+#include <vector>
+#include <memory>
+#include <cstdlib>
+#include <algorithm>
+#include <functional>
+#include <string_view>
+#include <fmt/core.h>
+
+#include <gummyd/gamma.hpp>
+#include <gummyd/gamma-backend.hpp>
+#include <gummyd/constants.hpp>
+
+using namespace gummyd;
+
+namespace {
+
+int failures = 0;
+
+void check(bool cond, std::string_view what) {
+    if (!cond) {
+        fmt::print(stderr, "failed: {}\n", what);
+        ++failures;
+    }
+}
+
+// The writer works on its own thread: give it time to catch up.
+bool wait_for(std::function<bool()> pred) {
+    const auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+    while (!pred()) {
+        if (std::chrono::steady_clock::now() > deadline)
+            return false;
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    return true;
+}
+
+} // namespace
+
+int main() {
+    const std::vector<size_t> sizes {7, 256, 1024};
+    const int brightness  = 500;
+    const int temperature = 3400;
+
+    uint64_t bytes_per_pass = 0;
+    for (const size_t sz : sizes)
+        bytes_per_pass += sz * 3 * sizeof(uint16_t);
+
+    // The highest refresh rate taken, so that pacing does not hold uploads back for long.
+    auto backend = std::make_unique<recording_gamma>(sizes, 1000.);
+    const recording_gamma &rec = *backend;
+
+    gamma_state state (std::move(backend));
+
+    const auto ramps_match = [&] (int brt, int temp) {
+        for (size_t i = 0; i < sizes.size(); ++i) {
+            const recording_gamma::ramps last = rec.last_ramps(i);
+            if (!last || *last != gamma_state::create_ramps(isa::SCALAR, brt, temp, sizes[i]))
+                return false;
+        }
+        return true;
+    };
+
+    check(rec.get_stats().uploads == 0, "nothing is uploaded before the first change");
+
+    // Storing does not upload, so both settings go out together: one upload per output.
+    for (size_t i = 0; i < sizes.size(); ++i) {
+        state.store_brightness(i, brightness);
+        state.set_temperature(i, temperature);
+    }
+    check(wait_for([&] { return ramps_match(brightness, temperature); }), "the last ramps match the settings");
+    check(rec.get_stats().uploads == sizes.size(), "one upload per output");
+    check(rec.get_stats().bytes == bytes_per_pass, "uploaded bytes match the ramp sizes");
+    check(rec.get_stats().flushes >= 1, "uploads are flushed");
+
+    // Same settings again: the ramps are identical, so nothing is sent.
+    for (size_t i = 0; i < sizes.size(); ++i)
+        state.set_temperature(i, temperature);
+    check(wait_for([&] {
+        const std::vector<uint64_t> skipped = state.get_skipped_uploads();
+        return std::ranges::all_of(skipped, [] (uint64_t n) { return n == 1; });
+    }), "unchanged ramps are skipped");
+    check(rec.get_stats().uploads == sizes.size(), "skipped ramps are not uploaded");
+
+    // A reset sends the same ramps again.
+    state.reset_gamma();
+    check(wait_for([&] { return rec.get_stats().uploads == 2 * sizes.size(); }), "a reset uploads every output");
+    check(rec.get_stats().bytes == 2 * bytes_per_pass, "a reset uploads full ramps");
+    check(ramps_match(brightness, temperature), "a reset keeps the settings");
+
+    // Out of range settings are clamped, like every other caller's.
+    state.set_brightness(0, 0);
+    check(wait_for([&] {
+        const recording_gamma::ramps last = rec.last_ramps(0);
+        return last && *last == gamma_state::create_ramps(isa::SCALAR, constants::brt_steps_min, temperature, sizes[0]);
+    }), "brightness is clamped to brt_steps_min");
+
+    fmt::print("{} failures\n", failures);
+    return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,64 @@
+// Copyright 2021-2024 Francesco Fusco <f.fusco@pm.me>
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+// The SIMD kernels must count exactly the same histograms as the scalar ones.
+// Odd widths, offsets and pitches exercise the tails of the vector loops.
+
+#include <random>
+#include <vector>
+#include <numeric>
+#include <cstdlib>
+#include <fmt/core.h>
+
+#include <gummyd/luminance.hpp>
+
+using namespace gummyd;
+
+int main() {
+    std::mt19937 rng (1);
+    std::uniform_int_distribution<int> byte (0, 255);
+
+    int failures = 0;
+    size_t checks = 0;
+
+    for (size_t f = 0; f <= size_t(luminance::pixel_format::R5G6B5); ++f) {
+        const auto format = luminance::pixel_format(f);
+        const size_t bpp = luminance::bytes_per_pixel(format);
+
+        for (const int w : {1, 3, 5, 7, 9, 15, 17, 31, 33, 251}) {
+            for (const int h : {1, 3, 7}) {
+                const luminance::rect r {3, 1, w, h};
+                const size_t pitch = (r.x + w) * bpp + 5;
+
+                std::vector<uint8_t> buf ((r.y + h) * pitch);
+                for (uint8_t &b : buf)
+                    b = uint8_t(byte(rng));
+
+                luminance::histogram expected {};
+                luminance::histogram_pixels(isa::SCALAR, format, buf, pitch, r, expected);
+
+                if (std::accumulate(expected.begin(), expected.end(), 0u) != unsigned(w * h)) {
+                    fmt::print(stderr, "format {}, {}x{}: scalar kernel counted the wrong number of pixels\n", f, w, h);
+                    ++failures;
+                }
+
+                for (const isa set : {isa::SSE2, isa::AVX2}) {
+                    if (!isa_supported(set))
+                        continue;
+
+                    luminance::histogram hist {};
+                    luminance::histogram_pixels(set, format, buf, pitch, r, hist);
+                    ++checks;
+
+                    if (hist != expected) {
+                        fmt::print(stderr, "format {}, {}x{}: isa {} differs from scalar\n", f, w, h, int(set));
+                        ++failures;
+                    }
+                }
+            }
+        }
+    }
+
+    fmt::print("{} comparisons, {} failures\n", checks, failures);
+    return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}